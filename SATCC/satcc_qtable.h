@@ -0,0 +1,92 @@
+/*
+ * SATCC Q-table layout and file format, shared by tcp_satcc.ko,
+ * the training module and the userspace tools.
+ */
+#ifndef _SATCC_QTABLE_H
+#define _SATCC_QTABLE_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stdint.h>
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+#endif
+
+#define numOfState 3
+
+#define state0_max 240 	// throughput
+#define state1_max 100  // delay
+/*
+ * The third axis combines optional features, bin = ce * GRAD_BINS + grad:
+ * CE-marked fraction and smoothed RTT gradient. Each has one bin (unused)
+ * unless built with CE_BINS=n / GRAD_BINS=n.
+ */
+#ifndef SATCC_CE_BINS
+#define SATCC_CE_BINS 1
+#endif
+#ifndef SATCC_GRAD_BINS
+#define SATCC_GRAD_BINS 1
+#endif
+
+#define state2_max (SATCC_CE_BINS * SATCC_GRAD_BINS)
+
+#define numOfAction 3
+
+#define	sizeOfMatrix 	state0_max * state1_max * state2_max * numOfAction
+
+typedef struct
+{
+	u8 enabled;
+	int mat[sizeOfMatrix];
+	u8 row[numOfState];
+	u8 col;
+} Matrix;
+
+enum reward_kernel
+{
+	REWARD_SATCC,		// alpha * goodness / (beta * delay + gamma * retransmits)
+	REWARD_POWER,		// alpha * goodness * min_rtt / rtt
+	REWARD_LOG_UTILITY,	// alpha * log2(throughput) - gamma * retransmits
+	REWARD_DELAY_TARGET,	// alpha * goodness - beta * delay above delay_target_ms
+	REWARD_MAX,
+};
+
+// throughput axis
+enum rate_bins
+{
+	RATE_BINS_LINEAR,	// estimated kbit/s >> 9 (>> 8 in training tables of older releases)
+	RATE_BINS_LOG,		// 8 bins per octave of kbit/s, up to about 1 Tbit/s
+};
+
+/*
+ * A table file is a struct qtable_meta followed by the Matrix and, when
+ * QTABLE_VISITS is set, one u16 visit count per Matrix entry.
+ * Files without the magic are bare Matrix dumps of older releases.
+ */
+#define QTABLE_MAGIC	0x51544231	// "QTB1"
+#define QTABLE_VERSION	1
+
+#define QTABLE_VISITS	0x1
+#define QTABLE_LOG_RATE	0x2	// throughput axis is RATE_BINS_LOG
+
+struct qtable_meta
+{
+	u32 magic;
+	u32 version;
+	u32 size;		// sizeof(struct qtable_meta) of the writer
+	u32 flags;
+	u32 reward;		// enum reward_kernel
+	u32 alpha;
+	u32 beta;
+	u32 gamma;
+	u32 delay_target_ms;
+	u32 learning_rate;	// in 1/1024
+	u32 discount_factor;	// in 1/16
+	u32 update_rule;
+	u32 ce_weight;		// reward penalty at 100% CE-marked ACKs
+	u32 reserved[3];
+};
+
+#endif
@@ -1,38 +1,248 @@
 #include <linux/module.h>
 #include <net/tcp.h>
+#include <net/ipv6.h>
+#include <linux/inet_diag.h>
+#include <linux/pkt_sched.h>
 #include <linux/fs.h>
 #include <linux/uaccess.h>
 #include<linux/slab.h>
-
-#define numOfState 3
-
-#define state0_max 240 	// throughput
-#define state1_max 100  // delay
-#define state2_max 1 	// more
+#include <linux/spinlock.h>
+#include <linux/rcupdate.h>
+#include <linux/jhash.h>
+#include <linux/percpu.h>
+#include <linux/random.h>
+#include <linux/log2.h>
+#include <linux/vmalloc.h>
+#include <linux/proc_fs.h>
+#include <linux/sysctl.h>
+#include <linux/mutex.h>
+#include <linux/mm.h>
+#include <linux/nodemask.h>
+#include <linux/topology.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/jump_label.h>
+#include <net/net_namespace.h>
+#include <net/netns/generic.h>
+#ifdef CONFIG_MPTCP
+#include <net/mptcp.h>
+#endif
+
+#include "satcc_qtable.h"
 
 #define Q_CONG_SCALE 1024
 
-#define numOfAction 3
-
 #define epsilon 1
 
-#define	sizeOfMatrix 	state0_max * state1_max * state2_max * numOfAction
-
 static const u32 probertt_interval_msec = 10000;
 static const u32 max_probertt_duration_msecs = 200;
 
-static const u32 alpha = 4;
-static const u32 beta = 1;
-static const u32 gamma = 1;
+// per network namespace tunables, also under net.satcc.* sysctls
+struct satcc_params
+{
+	unsigned int explore;
+	unsigned int explore_budget;
+	unsigned int reward;
+	unsigned int alpha;
+	unsigned int beta;
+	unsigned int gamma;
+	unsigned int delay_target_ms;
+	unsigned int rate_bins;
+	unsigned int ce_weight;
+	atomic_t explorations;		// counter, read-only
+};
+
+#define SATCC_PARAMS_INIT			\
+{						\
+	.explore = 1,				\
+	.explore_budget = 0,			\
+	.reward = REWARD_SATCC,			\
+	.alpha = 4,				\
+	.beta = 1,				\
+	.gamma = 1,				\
+	.delay_target_ms = 50,			\
+	.rate_bins = RATE_BINS_LINEAR,		\
+	.ce_weight = 100,			\
+	.explorations = ATOMIC_INIT(0),		\
+}
+
+// the module parameters are init_net's values and the defaults of new namespaces
+static struct satcc_params satcc_defaults = SATCC_PARAMS_INIT;
+// compiled-in values, to tell parameters the admin set from untouched ones
+static const struct satcc_params satcc_builtin = SATCC_PARAMS_INIT;
+
+module_param_named(reward, satcc_defaults.reward, uint, 0644);
+MODULE_PARM_DESC(reward, "Reward kernel: 0 satcc, 1 power, 2 log-utility, 3 delay-target");
+
+module_param_named(alpha, satcc_defaults.alpha, uint, 0644);
+MODULE_PARM_DESC(alpha, "Reward throughput weight");
+
+module_param_named(beta, satcc_defaults.beta, uint, 0644);
+MODULE_PARM_DESC(beta, "Reward delay weight");
+
+module_param_named(gamma, satcc_defaults.gamma, uint, 0644);
+MODULE_PARM_DESC(gamma, "Reward retransmission weight");
+
+module_param_named(delay_target_ms, satcc_defaults.delay_target_ms, uint, 0644);
+MODULE_PARM_DESC(delay_target_ms, "Queueing delay the delay-target reward tolerates without penalty");
+
+module_param_named(rate_bins, satcc_defaults.rate_bins, uint, 0644);
+MODULE_PARM_DESC(rate_bins, "Throughput state axis: 0 linear, 1 logarithmic (1 kbit/s to 1 Tbit/s); tables with metadata set it");
+
+module_param_named(ce_weight, satcc_defaults.ce_weight, uint, 0644);
+MODULE_PARM_DESC(ce_weight, "Reward penalty when every ACK of an interval echoes CE, scaled by the marked fraction");
+
+static unsigned int rtt_grad_step = 64;
+module_param(rtt_grad_step, uint, 0644);
+MODULE_PARM_DESC(rtt_grad_step, "Width of an RTT-gradient state bin, in 1/1024 (64: RTT grows 1 ms per 16 ms)");
+
+static unsigned int recovery_beta = 717;
+module_param(recovery_beta, uint, 0644);
+MODULE_PARM_DESC(recovery_beta, "cwnd after fast recovery (ssthresh), in 1/1024 of the cwnd before the loss");
+
+static unsigned int recovery_skip_updates = 0;
+module_param(recovery_skip_updates, uint, 0644);
+MODULE_PARM_DESC(recovery_skip_updates, "Decision intervals overlapping loss recovery: 0 learn from them (counted in recovery_intervals), 1 skip their Q update");
+
+static unsigned int recovery_intervals = 0;
+module_param(recovery_intervals, uint, 0444);
+MODULE_PARM_DESC(recovery_intervals, "Decision intervals that overlapped loss recovery since load");
+
+static unsigned int cadence = 0;
+module_param(cadence, uint, 0644);
+MODULE_PARM_DESC(cadence, "Decision interval: 0 cadence_rounds x min RTT of wall time, 1 cadence_rounds RTT rounds counted by delivered packets");
+
+static unsigned int cadence_rounds = 2;
+module_param(cadence_rounds, uint, 0644);
+MODULE_PARM_DESC(cadence_rounds, "Nominal decision interval, in min RTTs or RTT rounds");
+
+static unsigned int cadence_adaptive = 0;
+module_param(cadence_adaptive, uint, 0644);
+MODULE_PARM_DESC(cadence_adaptive, "Halve the decision interval (down to 1/2 nominal) when the state jumps, grow it (up to 4x) while it holds");
+
+static unsigned int handover = 0;
+module_param(handover, uint, 0644);
+MODULE_PARM_DESC(handover, "Detect satellite handovers and rebase min RTT, state and bandwidth on them");
+
+static unsigned int handover_rtt_pct = 20;
+module_param(handover_rtt_pct, uint, 0644);
+MODULE_PARM_DESC(handover_rtt_pct, "Step of the per-interval minimum RTT over min RTT, in percent, taken as a handover");
+
+static unsigned int handover_rate_pct = 50;
+module_param(handover_rate_pct, uint, 0644);
+MODULE_PARM_DESC(handover_rate_pct, "Step of the delivery rate, in percent, taken as a handover when the base RTT also moved");
+
+static unsigned int handover_period_ms = 0;
+module_param(handover_period_ms, uint, 0644);
+MODULE_PARM_DESC(handover_period_ms, "Scheduled handovers every period on the wall clock (e.g. 15000), 0 for none");
+
+static unsigned int handover_phase_ms = 0;
+module_param(handover_phase_ms, uint, 0644);
+MODULE_PARM_DESC(handover_phase_ms, "Offset of the scheduled handovers within the period");
+
+static unsigned int handover_probe_ms = 100;
+module_param(handover_probe_ms, uint, 0644);
+MODULE_PARM_DESC(handover_probe_ms, "Bandwidth re-probe after a handover, 0 to disable");
+
+static unsigned int handovers = 0;
+module_param(handovers, uint, 0444);
+MODULE_PARM_DESC(handovers, "Handovers detected or scheduled since load");
+
+static unsigned int fallback = 1;
+module_param(fallback, uint, 0644);
+MODULE_PARM_DESC(fallback, "Decide by a queueing-delay model where all Q-values tie (otherwise hold, or random with explore)");
+
+static unsigned int fallback_queue_pct = 25;
+module_param(fallback_queue_pct, uint, 0644);
+MODULE_PARM_DESC(fallback_queue_pct, "Queueing delay, in percent of min RTT, above which the fallback policy drains");
+
+static unsigned int ecn = 0;
+module_param(ecn, uint, 0444);
+MODULE_PARM_DESC(ecn, "Negotiate ECN and use the CE-marked fraction in state and reward");
 
 static const char procname[] = "satcc";
 
-static const int learning_rate = 512;
-static const int discount_factor = 12;
+#define LEARNING_RATE_INIT 512
+#define DISCOUNT_FACTOR_INIT 12
+
+static int learning_rate = LEARNING_RATE_INIT;
+module_param(learning_rate, int, 0644);
+MODULE_PARM_DESC(learning_rate, "Q learning rate, in 1/1024");
+
+static int discount_factor = DISCOUNT_FACTOR_INIT;
+module_param(discount_factor, int, 0644);
+MODULE_PARM_DESC(discount_factor, "Q discount factor, in 1/16");
 
 #define MY_READ_FILE "/qtable-train-result-500ms"
 #define MY_SAVE_FILE "/qtable"
 
+module_param_named(explore, satcc_defaults.explore, uint, 0644);
+MODULE_PARM_DESC(explore, "Epsilon exploration on live traffic, 0 for pure greedy inference");
+
+module_param_named(explore_budget, satcc_defaults.explore_budget, uint, 0644);
+MODULE_PARM_DESC(explore_budget, "Random actions allowed per flow (max 255), 0 for no limit");
+
+static unsigned int explore_rate = 0;
+module_param(explore_rate, uint, 0644);
+MODULE_PARM_DESC(explore_rate, "Random actions allowed per second on the host, 0 for no limit");
+
+module_param_named(explorations, satcc_defaults.explorations.counter, int, 0444);
+MODULE_PARM_DESC(explorations, "Random actions taken in init_net since load");
+
+static unsigned int share_table = 0;
+module_param(share_table, uint, 0644);
+MODULE_PARM_DESC(share_table, "New flows read the NUMA-local replica of the table instead of adapting a private copy");
+
+static unsigned int warm_start = 0;
+module_param(warm_start, uint, 0644);
+MODULE_PARM_DESC(warm_start, "Start new flows from the cached state of the last flow to the same destination prefix");
+
+static unsigned int warm_prefix = 24;
+module_param(warm_prefix, uint, 0644);
+MODULE_PARM_DESC(warm_prefix, "IPv4 prefix length the warm-start cache is keyed by (IPv6 uses /64)");
+
+static unsigned int warm_ttl_sec = 300;
+module_param(warm_ttl_sec, uint, 0644);
+MODULE_PARM_DESC(warm_ttl_sec, "Age after which a warm-start cache entry is ignored");
+
+static unsigned int warm_cwnd_pct = 50;
+module_param(warm_cwnd_pct, uint, 0644);
+MODULE_PARM_DESC(warm_cwnd_pct, "Percent of the cached final cwnd a warm-started flow begins with");
+
+#define SATCC_ARMS 4	// arm 0 is the namespace table, the others are loaded through /proc/net/satcc_armN
+
+static unsigned int ab_weight[SATCC_ARMS] = {100, 0, 0, 0};
+module_param_array(ab_weight, uint, NULL, 0644);
+MODULE_PARM_DESC(ab_weight, "Share of new init_net flows per experiment arm, arm 0 runs the namespace table; arms without a table are skipped");
+
+static unsigned int ab_seed = 0;
+module_param(ab_seed, uint, 0644);
+MODULE_PARM_DESC(ab_seed, "Seed of the 4-tuple hash that assigns flows to arms, change it to reshuffle");
+
+static unsigned int group = 0;
+module_param(group, uint, 0644);
+MODULE_PARM_DESC(group, "Group flows that likely share a bottleneck for state and cwnd steps: 0 off, 1 by destination prefix, 2 by egress device");
+
+static unsigned int group_prefix = 24;
+module_param(group_prefix, uint, 0644);
+MODULE_PARM_DESC(group_prefix, "IPv4 destination prefix length that groups flows, IPv6 groups by /64");
+
+static unsigned int slo_mark_mask = 0;
+module_param(slo_mark_mask, uint, 0644);
+MODULE_PARM_DESC(slo_mark_mask, "Bits of sk_mark (SO_MARK, BPF sock_ops) that carry a per-socket queueing delay target in ms, 0 for none");
+
+static unsigned int slo_interactive_ms = 0;
+module_param(slo_interactive_ms, uint, 0644);
+MODULE_PARM_DESC(slo_interactive_ms, "Queueing delay target of sockets with SO_PRIORITY TC_PRIO_INTERACTIVE, 0 for none");
+
+static unsigned int slo_arm = 0;
+module_param(slo_arm, uint, 0644);
+MODULE_PARM_DESC(slo_arm, "Experiment arm whose table flows with a delay target at setup decide by, 0 to keep their arm");
+
+static unsigned int shadow_arm = 0;
+module_param(shadow_arm, uint, 0644);
+MODULE_PARM_DESC(shadow_arm, "Compare every decision with the greedy action of this arm's table without applying it, 0 for off");
+
 enum action
 {
 	CWND_UP,
@@ -48,20 +258,304 @@ enum q_cong_mode
 	STARTUP,
 };
 
-typedef struct
+static Matrix matrix;
+
+struct satcc_net
+{
+	struct satcc_params params;	// own copy, init_net uses satcc_defaults
+	struct satcc_params *p;
+	Matrix *matrix;			// NULL until a table is loaded, flows then use init_net's
+	rwlock_t lock;			// protects *matrix
+	struct satcc_replicas __rcu *replicas;	// read-only copies of *matrix
+	struct ctl_table_header *sysctl;
+};
+
+static unsigned int satcc_net_id __read_mostly;
+static DEFINE_MUTEX(satcc_table_mutex);
+
+static struct satcc_net *satcc_pernet(const struct net *net)
 {
-	u8 enabled;
-	int mat[sizeOfMatrix];
-	u8 row[numOfState];
-	u8 col;
-} Matrix;
+	return net_generic(net, satcc_net_id);
+}
 
-static Matrix matrix;
+// namespace whose table new flows in net start from
+static struct satcc_net *satcc_table_owner(const struct net *net)
+{
+	struct satcc_net *sn = satcc_pernet(net);
 
-struct Q_cong
+	return READ_ONCE(sn->matrix) ? sn : satcc_pernet(&init_net);
+}
+
+/*
+ * Flows in share_table mode read the copy of their namespace's table on
+ * the memory node of the CPU running their ACK processing. Replicas are
+ * physically contiguous when possible, so they sit in the direct map and
+ * are covered by its huge page mappings; a load swaps the whole set under
+ * RCU so all nodes move to the new table together.
+ */
+struct satcc_replicas
+{
+	struct rcu_head rcu;
+	Matrix *node[];		// nr_node_ids entries, NULL for nodes without memory
+};
+
+static Matrix *satcc_replica_alloc(int nid)
+{
+	struct page *page;
+
+	page = alloc_pages_node(nid, GFP_KERNEL | __GFP_THISNODE | __GFP_NOWARN | __GFP_NORETRY,
+							get_order(sizeof(Matrix)));
+	if (page)
+		return page_address(page);
+	return vmalloc_node(sizeof(Matrix), nid);
+}
+
+static void satcc_replica_free(Matrix *m)
+{
+	if (is_vmalloc_addr(m))
+		vfree(m);
+	else if (m)
+		free_pages((unsigned long)m, get_order(sizeof(Matrix)));
+}
+
+static void satcc_replicas_free(struct satcc_replicas *r)
+{
+	int nid;
+
+	for (nid = 0; nid < nr_node_ids; nid++)
+		satcc_replica_free(r->node[nid]);
+	kfree(r);
+}
+
+static void satcc_replicas_free_rcu(struct rcu_head *head)
+{
+	satcc_replicas_free(container_of(head, struct satcc_replicas, rcu));
+}
+
+static struct satcc_replicas *satcc_replicas_build(const Matrix *src)
+{
+	struct satcc_replicas *r;
+	int nid;
+
+	r = kzalloc(sizeof(*r) + nr_node_ids * sizeof(r->node[0]), GFP_KERNEL);
+	if (!r)
+		return NULL;
+	for_each_node_state(nid, N_MEMORY)
+	{
+		r->node[nid] = satcc_replica_alloc(nid);
+		if (!r->node[nid])
+		{
+			satcc_replicas_free(r);
+			return NULL;
+		}
+		memcpy(r->node[nid], src, sizeof(Matrix));
+	}
+	return r;
+}
+
+// publishes fresh replicas of *sn->matrix, called with satcc_table_mutex held
+static int satcc_replicas_refresh(struct satcc_net *sn, const Matrix *src)
+{
+	struct satcc_replicas *r, *old;
+
+	r = satcc_replicas_build(src);
+	if (!r)
+		return -ENOMEM;
+	old = rcu_dereference_protected(sn->replicas, lockdep_is_held(&satcc_table_mutex));
+	rcu_assign_pointer(sn->replicas, r);
+	if (old)
+		call_rcu(&old->rcu, satcc_replicas_free_rcu);
+	return 0;
+}
+
+// caller holds rcu_read_lock(), NULL if the namespace has no replicas
+static Matrix *satcc_local_replica(const struct net *net)
+{
+	struct satcc_replicas *r = rcu_dereference(satcc_table_owner(net)->replicas);
+
+	return r ? r->node[numa_mem_id()] : NULL;
+}
+
+/*
+ * A/B experiments: init_net flows are assigned to an arm at init by a hash
+ * of their 4-tuple, weighted by ab_weight. Arm tables are replaced whole
+ * under RCU by a load and never unloaded. When a flow closes, its goodput,
+ * RTT inflation, retransmissions and completion time are added to the
+ * sums of its arm in /proc/net/satcc_ab; sums of squares are kept as
+ * well, so means and confidence intervals can be computed from them.
+ */
+static Matrix __rcu *arm_tables[SATCC_ARMS];	// [0] unused
+
+enum ab_stat
+{
+	AB_FLOWS,
+	AB_GOODPUT_KBPS,
+	AB_GOODPUT_SQ,		// in (Mbit/s)^2
+	AB_RTT_INFLATION,	// srtt over min RTT at close, in percent
+	AB_RTT_INFLATION_SQ,
+	AB_RETRANS,
+	AB_SEGS_OUT,
+	AB_FCT_MS,
+	AB_FCT_SQ,		// in ms^2
+	AB_MAX,
+};
+
+static const char * const ab_stat_names[AB_MAX] = {
+	"flows", "goodput_kbps", "goodput_sq_mbps2", "rtt_inflation_pct", "rtt_inflation_sq",
+	"retrans", "segs_out", "fct_ms", "fct_sq_ms2",
+};
+
+static atomic64_t ab_stats[SATCC_ARMS][AB_MAX];
+
+// key of the peer's network: its IPv4 prefix, also for v4-mapped peers, or its IPv6 /64
+static u32 satcc_peer_key(struct sock *sk, u32 prefix)
+{
+	u32 addr = ntohl(sk->sk_daddr);
+
+	prefix = min_t(u32, prefix, 32);
+#if IS_ENABLED(CONFIG_IPV6)
+	if (sk->sk_family == AF_INET6)
+	{
+		if (!ipv6_addr_v4mapped(&sk->sk_v6_daddr))
+			return jhash_2words(sk->sk_v6_daddr.s6_addr32[0], sk->sk_v6_daddr.s6_addr32[1], 0);
+		addr = ntohl(sk->sk_v6_daddr.s6_addr32[3]);
+	}
+#endif
+	if (prefix == 0)
+		return 0;
+	return addr & (~0U << (32 - prefix));
+}
+
+static u32 satcc_flow_hash(struct sock *sk)
+{
+	u32 ports = ((u32)ntohs(sk->sk_dport) << 16) | sk->sk_num;
+
+#if IS_ENABLED(CONFIG_IPV6)
+	if (sk->sk_family == AF_INET6)
+		return jhash2(sk->sk_v6_daddr.s6_addr32, 4,
+					  jhash2(sk->sk_v6_rcv_saddr.s6_addr32, 4, ports ^ ab_seed));
+#endif
+	return jhash_3words(sk->sk_daddr, sk->sk_rcv_saddr, ports, ab_seed);
+}
+
+static u32 satcc_pick_arm(struct sock *sk)
+{
+	u32 weight[SATCC_ARMS];
+	u32 total = 0;
+	u32 h;
+	int i;
+
+	if (!net_eq(sock_net(sk), &init_net))
+		return 0;
+	for (i = 0; i < SATCC_ARMS; i++)
+	{
+		weight[i] = READ_ONCE(ab_weight[i]);
+		if (i && !rcu_access_pointer(arm_tables[i]))
+			weight[i] = 0;
+		total += weight[i];
+	}
+	if (total == weight[0])
+		return 0;
+
+	h = satcc_flow_hash(sk) % total;
+	for (i = 0; h >= weight[i]; i++)
+		h -= weight[i];
+	return i;
+}
+
+// table a flow without a private copy reads, caller holds rcu_read_lock(); may be NULL
+static Matrix *satcc_flow_table(struct sock *sk, u8 arm)
+{
+	Matrix *m = arm ? rcu_dereference(arm_tables[arm]) : NULL;
+
+	return m ? m : satcc_local_replica(sock_net(sk));
+}
+
+static DEFINE_PER_CPU(struct rnd_state, satcc_rnd_state);
+
+// explore_rate is split evenly across CPUs so the ACK path never shares the window
+struct explore_window
 {
-	bool forced_update;
+	u32 stamp;
+	u32 count;
+};
+static DEFINE_PER_CPU(struct explore_window, satcc_explore_window);
+
+#define WARM_CACHE_SIZE 1024	// slots, power of 2, one entry per slot
+
+struct warm_entry
+{
+	struct rcu_head rcu;
+	u32 key;
+	u32 net;	// net_hash_mix() of the owning namespace
+	u16 family;
+	u8 epsilon_step;
+	u32 stamp;
+	u32 min_rtt_us;
+	u32 throughput;
+	u32 cwnd;
+};
+
+static struct warm_entry __rcu *warm_cache[WARM_CACHE_SIZE];
+static DEFINE_SPINLOCK(warm_cache_lock);
+
+/*
+ * Flows to the same destination prefix or out of the same device likely
+ * share the terminal's bottleneck and would otherwise all see the same
+ * rising RTT and step together. Grouped flows take the group's aggregate
+ * rate and smoothed queueing delay as state and divide their cwnd
+ * increase by the group size, so the aggregate moves like one flow.
+ */
+#define GROUP_HASH_SIZE 256	// buckets, power of 2
+
+enum group_mode
+{
+	GROUP_OFF,
+	GROUP_PREFIX,
+	GROUP_DEVICE,
+};
+
+struct satcc_group
+{
+	struct hlist_node node;
+	u32 key;
+	u32 net;		// net_hash_mix() of the owning namespace
+	u16 family;
+	u8 mode;
+	int flows;		// members, under satcc_group_lock
+	atomic_long_t rate;	// sum of the members' rates, kbit/s
+	u32 qdelay_us;		// EWMA of the members' queueing delay samples
+};
+
+static struct hlist_head satcc_groups[GROUP_HASH_SIZE];
+static DEFINE_SPINLOCK(satcc_group_lock);
+
+// per-flow state that does not fit in the icsk_ca_priv area
+struct Q_cong_ext
+{
+	u32 last_srtt_us;	// srtt at the last decision
+	s16 rtt_grad;		// smoothed srtt gradient, in 1/1024
+	u32 interval_min_rtt_us;	// lowest RTT sample since the last decision
+	u32 prev_min_rtt_us;	// same for the interval before
+	u32 handover_slot;	// scheduled handover slot of the last decision
+	u32 decisions;
+	u32 fallbacks;		// decisions taken by fallback_action()
+	u32 interval_ms;	// length of the last decision interval
+	u32 round_delivered;	// tp->delivered at the start of the RTT round
+	u8 rounds;		// RTT rounds since the last decision
+	u8 cadence_scale;	// decision interval in quarters of the nominal one
+	u32 start_stamp;	// jiffies at init, for the completion time
+	struct satcc_group *group;	// shared bottleneck group, NULL if not grouped
+	u32 group_rate;		// this flow's share of group->rate
+	u32 delay_target_us;	// per-socket queueing delay target, 0 for none
+	u32 loss_cwnd;		// cwnd before the last loss, for undo
+	u16 ce_frac;		// CE-marked fraction of the last interval, in 1/1024
+	u16 ce_acked;		// packets acked in this interval
+	u16 ce_marked;		// of which acked by ACKs echoing CE
+};
 
+struct Q_cong
+{
 	u32 mode : 3,
 		exited : 1,
 		up_times : 4,
@@ -69,15 +563,19 @@ struct Q_cong
 		up_n : 3,
 		epsilon_step : 6,
 		epsilon_count : 4,
-		unused : 11;
+		explore_count : 8,
+		ece : 1,
+		idle : 1,
+		app_limited : 1,
+		recovery : 1,
+		action : 8,	// -1 (all ones) before the first decision
+		arm : 2;	// A/B experiment arm, 0 for the namespace table
 	u32 last_sequence;
 	u32 estimated_throughput;
-	u16 last_throughput_mean[5];
 	u32 last_update_stamp;
 	u32 last_packet_loss;
 	u32 retransmit_during_interval;
 
-    u8 throughput_count;
 	u32 smooth_throughput;
 
 	u32 last_probertt_stamp;
@@ -85,12 +583,13 @@ struct Q_cong
 	u32 min_rtt_us;
 	u32 prop_rtt_us;
 	u16 prior_cwnd;
+	u16 last_throughput_mean[5];	// rate_pack()ed
 
 	u16 current_state[numOfState];
 	u16 prev_state[numOfState];
-	u8 action;
 
 	Matrix *qtable;
+	struct Q_cong_ext *ext;	// NULL if the allocation failed, extra features then stay idle
 };
 
 static int matrix_init = 0;
@@ -129,6 +628,13 @@ static void eraseMatrix(Matrix *m)
 	m->enabled = 0;
 }
 
+// lookups stride by the table's own dims, so they must be the build's
+static bool matrix_layout_ok(const Matrix *m)
+{
+	return m->col == numOfAction && m->row[0] == state0_max &&
+		m->row[1] == state1_max && m->row[2] == state2_max;
+}
+
 static void setMatValue(Matrix *m, u16 row1, u16 row2, u16 row3, u16 col, int v){
 	u32 index = 0; 
 	if (!m)
@@ -148,85 +654,295 @@ static int getMatValue(Matrix *m, u16 row1, u16 row2, u16 row3, u16 col){
 	return *(m -> mat + index);
 }
 
+static void fill_meta(struct qtable_meta *meta, struct satcc_params *p)
+{
+	memset(meta, 0, sizeof(*meta));
+	meta->magic = QTABLE_MAGIC;
+	meta->version = QTABLE_VERSION;
+	meta->size = sizeof(*meta);
+	meta->reward = p->reward;
+	meta->alpha = p->alpha;
+	meta->beta = p->beta;
+	meta->gamma = p->gamma;
+	meta->delay_target_ms = p->delay_target_ms;
+	meta->ce_weight = p->ce_weight;
+	if (p->rate_bins == RATE_BINS_LOG)
+		meta->flags |= QTABLE_LOG_RATE;
+	meta->learning_rate = learning_rate;
+	meta->discount_factor = discount_factor;
+}
+
+/*
+ * Takes over the table's value where the parameter still has its unset
+ * value and logs it; a value the admin set is kept with a warning, as
+ * the training module does.
+ */
+#define ADOPT_META(name, v, unset, table)						\
+	do {										\
+		if ((v) == (table))							\
+			break;								\
+		if ((v) == (unset))							\
+		{									\
+			printk(KERN_INFO "satcc: %s %u from the table, was %u",		\
+				   name, (u32)(table), (u32)(v));			\
+			(v) = (table);							\
+		}									\
+		else									\
+			printk(KERN_WARNING "satcc: keeping %s %u, the table was trained with %u", \
+				   name, (u32)(v), (u32)(table));			\
+	} while (0)
+
+/*
+ * Online updates follow the objective the table was trained for. At
+ * insmod, unset are the compiled-in values; a table written to
+ * /proc/net/satcc_qtable passes the namespace's own and always applies.
+ */
+static void adopt_meta(struct satcc_params *p, const struct satcc_params *unset, struct qtable_meta *meta)
+{
+	ADOPT_META("reward", p->reward, unset->reward, meta->reward);
+	ADOPT_META("alpha", p->alpha, unset->alpha, meta->alpha);
+	ADOPT_META("beta", p->beta, unset->beta, meta->beta);
+	ADOPT_META("gamma", p->gamma, unset->gamma, meta->gamma);
+	ADOPT_META("delay_target_ms", p->delay_target_ms, unset->delay_target_ms, meta->delay_target_ms);
+	ADOPT_META("ce_weight", p->ce_weight, unset->ce_weight, meta->ce_weight);
+	// the axis layout is part of the table, unlike the objective
+	p->rate_bins = meta->flags & QTABLE_LOG_RATE ? RATE_BINS_LOG : RATE_BINS_LINEAR;
+}
+
 static void save_Matrix(Matrix *m)
 {
 	struct file *fp;
+	struct qtable_meta meta;
 	loff_t pos;
 	ssize_t res = 0;
 	printk(KERN_INFO "write enter/n");
-	fp = filp_open(MY_SAVE_FILE, O_RDWR | O_CREAT, 0777);
+	fp = filp_open(MY_SAVE_FILE, O_RDWR | O_CREAT | O_TRUNC, 0777);
 	if (IS_ERR(fp))
 	{
 		printk(KERN_INFO "create file error/n");
 		return;
 	}
 
+	fill_meta(&meta, &satcc_defaults);
+
 	pos = 0;
-	res = kernel_write(fp, m, sizeof(Matrix), &pos);
+	res = kernel_write(fp, &meta, sizeof(meta), &pos);
+	if (res >= 0)
+		res = kernel_write(fp, m, sizeof(Matrix), &pos);
 	if (res < 0)
-	{
 		printk(KERN_INFO "kernel_write error: %ld\n", res);
-		return;
-	}
 
 	filp_close(fp, NULL);
 }
 
-static void read_Matrix(Matrix *m)
+/*
+ * Loads a table written by the training module or a bare Matrix dump of
+ * older releases. Returns 1 and fills *meta when the file carries metadata.
+ */
+static int read_Matrix(Matrix *m, struct qtable_meta *meta)
 {
 	struct file *fp;
 	loff_t pos;
 	ssize_t res = 0;
+	int has_meta = 0;
 	printk(KERN_INFO "reader enter/n");
 	fp = filp_open(MY_READ_FILE, O_RDWR | O_CREAT, 0777);
 	if (IS_ERR(fp))
 	{
 		printk(KERN_INFO "create file error/n");
-		return;
+		return 0;
 	}
 
 	pos = 0;
+	res = kernel_read(fp, meta, sizeof(*meta), &pos);
+	if (res == sizeof(*meta) && meta->magic == QTABLE_MAGIC && meta->size >= offsetof(struct qtable_meta, reserved))
+	{
+		has_meta = 1;
+		pos = meta->size;
+		if (meta->size < sizeof(*meta))
+			memset((char *)meta + meta->size, 0, sizeof(*meta) - meta->size);
+	}
+	else
+		pos = 0;
+
 	res = kernel_read(fp, m, sizeof(Matrix), &pos);
 	if (res < 0)
 	{
 		printk("kernel_read error: %ld\n", res);
-		return;
+		filp_close(fp, NULL);
+		return 0;
 	}
 	printk("read: %p/n", &m);
 
 	filp_close(fp, NULL);
+	return has_meta;
 }
 
-static u32 q_cong_ssthresh(struct sock *sk)
+/*
+ * Per-ACK cost: per-CPU log2 histograms of local_clock() deltas, bucket k
+ * counts calls that took [2^k, 2^(k+1)) ns. Off by default; the static key
+ * leaves a patched-out branch per stage when disabled. Controlled through
+ * /sys/kernel/debug/satcc/: latency_enable (0/1), latency (read, or write
+ * anything to reset).
+ */
+enum satcc_stage
+{
+	STAGE_MAIN,	// q_cong_main()
+	STAGE_STATE,	// throughput, CE, gradient, handover and state update
+	STAGE_UPDATE,	// Q update
+	STAGE_ACTION,	// getAction()
+	STAGE_EXECUTE,	// executeAction()
+	STAGE_MAX,
+};
+
+static const char * const satcc_stage_names[STAGE_MAX] = {
+	"main", "state", "update", "action", "execute",
+};
+
+#define LAT_BUCKETS 32
+
+struct satcc_lat
+{
+	u64 count[STAGE_MAX][LAT_BUCKETS];
+};
+
+static DEFINE_PER_CPU(struct satcc_lat, satcc_lat);
+static DEFINE_STATIC_KEY_FALSE(satcc_lat_enabled);
+static struct dentry *satcc_debugfs;
+
+static inline u64 lat_start(void)
+{
+	if (static_branch_unlikely(&satcc_lat_enabled))
+		return local_clock();
+	return 0;
+}
+
+static inline void lat_end(enum satcc_stage stage, u64 start)
+{
+	u64 ns;
+
+	if (static_branch_unlikely(&satcc_lat_enabled) && start)
+	{
+		ns = local_clock() - start;
+		this_cpu_inc(satcc_lat.count[stage][min_t(u32, ilog2(ns | 1), LAT_BUCKETS - 1)]);
+	}
+}
+
+/*
+ * Shadow evaluation: at each decision, the greedy action of the shadow
+ * arm's table is looked up next to the action taken and only counted.
+ * Per-CPU counters by (action taken, shadow action) and by state region,
+ * plus the shadow table's own Q margin of its choice over the action
+ * taken. Read from /sys/kernel/debug/satcc/shadow, write to reset.
+ */
+#define SHADOW_TIE numOfAction		// shadow table has no preference
+#define SHADOW_RATE_REGIONS 8		// throughput axis in 8 bands
+#define SHADOW_DELAY_REGIONS 4		// delay axis in 4 bands
+
+struct satcc_shadow
+{
+	u64 pairs[numOfAction][numOfAction + 1];
+	u64 decisions[SHADOW_RATE_REGIONS][SHADOW_DELAY_REGIONS];
+	u64 disagree[SHADOW_RATE_REGIONS][SHADOW_DELAY_REGIONS];
+	s64 q_margin;	// sum of Q(shadow choice) - Q(action taken) on disagreement
+};
+
+static DEFINE_PER_CPU(struct satcc_shadow, satcc_shadow);
+
+// cheap per-CPU PRNG for exploration, get_random_bytes() is too costly per decision
+static u32 satcc_random(void)
+{
+	struct rnd_state *state;
+	u32 rand;
+
+	state = get_cpu_ptr(&satcc_rnd_state);
+	rand = prandom_u32_state(state);
+	put_cpu_ptr(&satcc_rnd_state);
+
+	return rand;
+}
+
+// true while both the flow and the host still have exploration budget left
+static bool explore_allowed(struct satcc_params *p, struct Q_cong *qc)
 {
-	return TCP_INFINITE_SSTHRESH; /* TCP Q-congestion does not use ssthresh */
+	u32 rate;
+
+	if (p->explore_budget && qc->explore_count >= min_t(u32, p->explore_budget, 255))
+		return false;
+
+	rate = READ_ONCE(explore_rate);
+	if (rate)
+	{
+		struct explore_window *w = this_cpu_ptr(&satcc_explore_window);
+
+		if (after(tcp_jiffies32, w->stamp + HZ))
+		{
+			w->stamp = tcp_jiffies32;
+			w->count = 0;
+		}
+		if (w->count >= DIV_ROUND_UP(rate, num_online_cpus()))
+			return false;
+	}
+	return true;
 }
 
 static u32 epsilon_expore(struct sock *sk, u32 max_index)
 {	
 	struct Q_cong *qc = inet_csk_ca(sk);
-	u32 rand;
-	u32 rand2;
+	struct satcc_params *p = satcc_pernet(sock_net(sk))->p;
 	u32 random_value;
-	get_random_bytes(&rand, sizeof(rand));
-	random_value = (rand % (10 * (1 + qc->epsilon_step)));
+
+	if (!p->explore || !explore_allowed(p, qc))
+		return max_index;
+
+	random_value = (satcc_random() % (10 * (1 + qc->epsilon_step)));
 	if (random_value >= epsilon)
 		return max_index;
-	get_random_bytes(&rand2, sizeof(rand2));
-	return rand2 % numOfAction;
+
+	if (qc->explore_count < 255)
+		qc->explore_count++;
+	this_cpu_inc(satcc_explore_window.count);
+	atomic_inc(&p->explorations);
+	return satcc_random() % numOfAction;
+}
+
+// rate history entries are u16 floats of kbit/s: 11-bit mantissa, 5-bit exponent
+static u16 rate_pack(u32 kbps)
+{
+	u16 exp = 0;
+
+	while (kbps >= 2048)
+	{
+		kbps >>= 1;
+		exp++;
+	}
+	return exp << 11 | kbps;
+}
+
+static u32 rate_unpack(u16 v)
+{
+	return (u32)(v & 0x7ff) << (v >> 11);
+}
+
+static u32 rate_history_mean(struct Q_cong *qc)
+{
+	u64 sum = 0;
+	u8 i;
+
+	for (i = 0; i < 5; i++)
+		sum += rate_unpack(qc->last_throughput_mean[i]);
+	return div_u64(sum, 5);
 }
 
 static void epsilon_update(struct sock *sk, const struct rate_sample *rs){
 	struct Q_cong *qc = inet_csk_ca(sk);
-	u8 i;
-	u32 sum_throughput;
+	u32 mean_throughput;
 	u32 change_th;
 	u32 change_rtt;
 
-	sum_throughput = 0;
-	for (i = 0; i < 5; i++)
-		sum_throughput += qc->last_throughput_mean[i];
-	change_th = ((int)(sum_throughput/5 - (qc->smooth_throughput>>5)) >= 0) ? (int)(sum_throughput/5 - (qc->smooth_throughput>>5)) : (int)((qc->smooth_throughput>>5) - sum_throughput/5);
+	mean_throughput = rate_history_mean(qc);
+	change_th = mean_throughput > qc->smooth_throughput ? mean_throughput - qc->smooth_throughput :
+			qc->smooth_throughput - mean_throughput;
 	
 	change_rtt = ((rs->rtt_us - qc->min_rtt_us)>>10) >= 0 ? (rs->rtt_us - qc->min_rtt_us)>>10 : (qc->min_rtt_us - rs->rtt_us)>>10;
 	
@@ -240,32 +956,58 @@ static void epsilon_update(struct sock *sk, const struct rate_sample *rs){
 		qc->epsilon_count = 0;
 	}
 
-	if((change_th > (qc->smooth_throughput>>8)) || (change_rtt > (qc->min_rtt_us>>13))){
+	if((change_th > (qc->smooth_throughput>>3)) || (change_rtt > (qc->min_rtt_us>>13))){
 		qc->epsilon_step = 0;
 	}
 }
 
-int softsigntt(int value, int throughput)
+int softsigntt(u32 value, u32 throughput)
 {
 	if(value == 0) value=1;
-    return value * 100 / (value + throughput);
+    return div64_u64((u64)value * 100, (u64)value + throughput);
+}
+
+/*
+ * Deterministic policy for states the table has no opinion on: drain a
+ * standing queue above fallback_queue_pct of min RTT, grow while the queue
+ * stays under a quarter of that, hold in between.
+ */
+static u32 fallback_action(struct sock *sk)
+{
+	struct tcp_sock *tp = tcp_sk(sk);
+	struct Q_cong *qc = inet_csk_ca(sk);
+	u32 srtt_us = tp->srtt_us >> 3;
+	u32 queue_us = srtt_us > qc->min_rtt_us ? srtt_us - qc->min_rtt_us : 0;
+	u32 high_us = qc->min_rtt_us / 100 * fallback_queue_pct;
+
+	if (qc->ext)
+		qc->ext->fallbacks++;
+	if (queue_us > high_us)
+		return CWND_DOWN;
+	if (queue_us <= high_us / 4)
+		return CWND_UP;
+	return CWND_NOTHING;
 }
 
 static u32 getAction(struct sock *sk, const struct rate_sample *rs)
 {
 	struct Q_cong *qc = inet_csk_ca(sk);
+	Matrix *table;
 
-	u32 Q[numOfAction];
+	int Q[numOfAction];
 	u8 i;
 	u8 is_equal = 1;
 	u32 max_index = 0;
-	u32 max_tmp = 0;
-	u32 rand;
+	int max_tmp = 0;
 
+	rcu_read_lock();
+	table = qc->qtable ? qc->qtable : satcc_flow_table(sk, qc->arm);
+	// no table to read acts like an untrained one
 	for (i = 0; i < numOfAction; i++)
 	{
-		Q[i] = getMatValue(qc->qtable, qc->current_state[0], qc->current_state[1], qc->current_state[2], i);
+		Q[i] = table ? getMatValue(table, qc->current_state[0], qc->current_state[1], qc->current_state[2], i) : 0;
 	}
+	rcu_read_unlock();
 
 	max_tmp = Q[0];
 	for (i = 0; i < numOfAction; i++)
@@ -283,46 +1025,342 @@ static u32 getAction(struct sock *sk, const struct rate_sample *rs)
 		}
 	}
 
+	if (qc->ext)
+		qc->ext->decisions++;
+	if (is_equal && fallback)
+		return fallback_action(sk);
+	// greedy inference holds cwnd on a tie instead of a random walk
 	if (is_equal)
-	{
-		get_random_bytes(&rand, sizeof(rand));
-		max_index = (rand % numOfAction);
-	}
+		max_index = satcc_pernet(sock_net(sk))->p->explore ? (satcc_random() % numOfAction) : CWND_NOTHING;
 	// printk(KERN_INFO "choose action: %d, and it's q value is %d", max_index, max_tmp);
 	return epsilon_expore(sk, max_index);
 }
 
-static int getRewardFromEnvironment(struct sock *sk, const struct rate_sample *rs)
-{	
-	struct tcp_sock *tp = tcp_sk(sk);
+static void shadow_compare(struct sock *sk)
+{
 	struct Q_cong *qc = inet_csk_ca(sk);
-	u32 retransmit_division_factor;
-	int result;
+	Matrix *table;
+	int Q[numOfAction];
+	u32 best = SHADOW_TIE;
+	u32 rate, delay;
 	u8 i;
-	u32 sum_throughput;
-	u32 goodness;
-	int delay;
-	int fire;
 
-	retransmit_division_factor = qc->retransmit_during_interval + 1;
-	if (retransmit_division_factor == 0 || rs->rtt_us == 0)
-		return 0;
-	fire = retransmit_division_factor;
+	if (qc->action >= numOfAction || shadow_arm >= SATCC_ARMS)
+		return;
 
-	sum_throughput = 0;
-	for(i=0;i<5;i++){
-		sum_throughput += qc->last_throughput_mean[i];
+	rcu_read_lock();
+	table = rcu_dereference(arm_tables[shadow_arm]);
+	if (!table)
+	{
+		rcu_read_unlock();
+		return;
 	}
+	for (i = 0; i < numOfAction; i++)
+		Q[i] = getMatValue(table, qc->current_state[0], qc->current_state[1], qc->current_state[2], i);
+	rcu_read_unlock();
 
-	goodness = softsigntt(qc->estimated_throughput>>5 , (sum_throughput/5)); // 0-99
-
-	delay = (rs->rtt_us - qc->min_rtt_us)>>12;
-	if(delay<=0) delay=1;
-	result = alpha * goodness / (beta * delay + gamma * fire);
+	for (i = 0; i < numOfAction; i++)
+	{
+		if (Q[i] != Q[0])
+			best = 0;
+	}
+	if (best != SHADOW_TIE)
+	{
+		for (i = 1; i < numOfAction; i++)
+		{
+			if (Q[i] > Q[best])
+				best = i;
+		}
+	}
+
+	rate = qc->current_state[0] * SHADOW_RATE_REGIONS / state0_max;
+	delay = qc->current_state[1] * SHADOW_DELAY_REGIONS / state1_max;
+
+	// cong_control also runs from socket backlog processing with BH on
+	this_cpu_inc(satcc_shadow.pairs[qc->action][best]);
+	this_cpu_inc(satcc_shadow.decisions[rate][delay]);
+	if (best != SHADOW_TIE && best != qc->action)
+	{
+		this_cpu_inc(satcc_shadow.disagree[rate][delay]);
+		this_cpu_add(satcc_shadow.q_margin, Q[best] - Q[qc->action]);
+	}
+}
+
+// log2(v) in 1/8 steps
+static int log2_8(u32 v)
+{
+	u32 l;
+
+	if (v == 0)
+		return 0;
+	l = ilog2(v);
+	if (l >= 3)
+		return l * 8 + ((v >> (l - 3)) & 7);
+	return l * 8 + ((v << (3 - l)) & 7);
+}
+
+/*
+ * Per-socket delay target (latency SLO). Privileged applications and BPF
+ * sock_ops programs set it in the slo_mark_mask bits of sk_mark, any
+ * application gets slo_interactive_ms with SO_PRIORITY 6. Such flows are
+ * rewarded by the delay-target kernel with their own target, decide by
+ * the slo_arm table if it was set at connection setup, and have cwnd
+ * capped to what their rate needs in flight at the target while the
+ * measured queueing delay is above it.
+ */
+static u32 slo_target_us(struct sock *sk)
+{
+	u32 mask = READ_ONCE(slo_mark_mask);
+
+	if (mask && (sk->sk_mark & mask))
+		return ((sk->sk_mark & mask) >> __ffs(mask)) * USEC_PER_MSEC;
+	if (slo_interactive_ms && sk->sk_priority == TC_PRIO_INTERACTIVE)
+		return slo_interactive_ms * USEC_PER_MSEC;
+	return 0;
+}
+
+static void slo_cap(struct sock *sk, const struct rate_sample *rs)
+{
+	struct tcp_sock *tp = tcp_sk(sk);
+	struct Q_cong *qc = inet_csk_ca(sk);
+	u32 target_us = qc->ext ? qc->ext->delay_target_us : 0;
+	u64 cap;
+
+	if (!target_us || qc->mode != NOTHING || rs->rtt_us <= 0 || !qc->smooth_throughput)
+		return;
+	if (rs->rtt_us - (long)qc->min_rtt_us <= (long)target_us)
+		return;
+
+	// kbit/s x us / 8000 = bytes in flight at a queue of exactly the target
+	cap = div_u64((u64)qc->smooth_throughput * (qc->min_rtt_us + target_us), 8000 * max_t(u32, tp->mss_cache, 1));
+	tp->snd_cwnd = min_t(u64, tp->snd_cwnd, max_t(u64, cap, 4));
+}
+
+static int getRewardFromEnvironment(struct sock *sk, const struct rate_sample *rs)
+{	
+	struct Q_cong *qc = inet_csk_ca(sk);
+	struct satcc_params *p = satcc_pernet(sock_net(sk))->p;
+	u32 retransmit_division_factor;
+	int result;
+	u32 goodness;
+	int delay;
+	int queue_ms;
+	int fire;
+	u32 reward = p->reward;
+	u32 target_ms = p->delay_target_ms;
+
+	// a per-socket target selects the delay-target kernel
+	if (qc->ext && qc->ext->delay_target_us)
+	{
+		reward = REWARD_DELAY_TARGET;
+		target_ms = qc->ext->delay_target_us / USEC_PER_MSEC;
+	}
+
+	retransmit_division_factor = qc->retransmit_during_interval + 1;
+	if (retransmit_division_factor == 0 || rs->rtt_us == 0)
+		return 0;
+	fire = retransmit_division_factor;
+
+	goodness = softsigntt(qc->estimated_throughput, rate_history_mean(qc)); // 0-99
+
+	delay = (rs->rtt_us - qc->min_rtt_us)>>12;
+	if(delay<=0) delay=1;
+
+	switch (reward)
+	{
+	case REWARD_POWER:
+		result = p->alpha * goodness * (qc->min_rtt_us >> 4) / max_t(u32, rs->rtt_us >> 4, 1);
+		break;
+	case REWARD_LOG_UTILITY:
+		result = p->alpha * log2_8(qc->estimated_throughput) - p->gamma * (fire - 1) * 8;
+		break;
+	case REWARD_DELAY_TARGET:
+		queue_ms = (rs->rtt_us - qc->min_rtt_us) / USEC_PER_MSEC;
+		result = p->alpha * goodness - p->beta * max_t(int, queue_ms - (int)target_ms, 0);
+		break;
+	default:
+		result = p->alpha * goodness / max_t(u32, p->beta * delay + p->gamma * fire, 1);
+		break;
+	}
+	if (qc->ext)
+		result -= (int)(p->ce_weight * qc->ext->ce_frac >> 10);
 	// printk(KERN_INFO "reward : %d, goodness: %d, fire: %d, delay: %d,min_rtt: %d, throughput>>5: %d", result, goodness, fire, delay, qc->min_rtt_us>>10 , qc->estimated_throughput >> 5);
 	return result;
 }
 
+/*
+ * satcc_coupled: MPTCP subflows share connection-level state. The
+ * throughput axis of the state is the aggregate of all subflows that can
+ * send, the delay axis stays the subflow's own path, and CWND_UP is scaled
+ * by the linked-increase (RFC 6356) ratio so the connection takes no more
+ * than a single flow at a shared bottleneck and shifts load to the path
+ * with the best cwnd/rtt^2.
+ */
+#ifdef CONFIG_MPTCP
+static struct tcp_congestion_ops q_cong_coupled;
+
+static bool satcc_coupled(struct sock *sk)
+{
+	return mptcp(tcp_sk(sk)) && inet_csk(sk)->icsk_ca_ops == &q_cong_coupled;
+}
+
+static u32 coupled_throughput(struct sock *sk)
+{
+	struct mptcp_cb *mpcb = tcp_sk(sk)->mpcb;
+	struct sock *sub;
+	u64 total = 0;
+
+	mptcp_for_each_sk(mpcb, sub)
+	{
+		if (!mptcp_sk_can_send(sub) || inet_csk(sub)->icsk_ca_ops != &q_cong_coupled)
+			continue;
+		total += ((struct Q_cong *)inet_csk_ca(sub))->estimated_throughput;
+	}
+	return min_t(u64, total, U32_MAX);
+}
+
+// a * cwnd_i * (cwnd_k / rtt_k^2) / (sum_j cwnd_j / rtt_j)^2, k the best path, at most a
+static u32 coupled_increase(struct sock *sk, u32 a)
+{
+	struct mptcp_cb *mpcb = tcp_sk(sk)->mpcb;
+	struct sock *sub;
+	u64 score, best_score = 0;
+	u64 sum = 0;
+	u64 q;
+	u32 best_cwnd = 0, best_rtt = 0;
+	u32 rtt;
+
+	mptcp_for_each_sk(mpcb, sub)
+	{
+		if (!mptcp_sk_can_send(sub))
+			continue;
+		rtt = max_t(u32, tcp_sk(sub)->srtt_us >> 3, 1);
+		score = div64_u64((u64)tcp_sk(sub)->snd_cwnd << 32, (u64)rtt * rtt);
+		if (score >= best_score)
+		{
+			best_score = score;
+			best_cwnd = tcp_sk(sub)->snd_cwnd;
+			best_rtt = rtt;
+		}
+	}
+	if (!best_cwnd)
+		return a;
+
+	// sum_j cwnd_j / rtt_j in units of 1/(256 * best_rtt)
+	mptcp_for_each_sk(mpcb, sub)
+	{
+		if (!mptcp_sk_can_send(sub))
+			continue;
+		rtt = max_t(u32, tcp_sk(sub)->srtt_us >> 3, 1);
+		sum += div64_u64((u64)tcp_sk(sub)->snd_cwnd * best_rtt << 8, rtt);
+	}
+	if (!sum)
+		return a;
+
+	q = div64_u64((u64)tcp_sk(sk)->snd_cwnd << 16, sum);
+	return min_t(u64, div64_u64((u64)a * q * best_cwnd, sum), a);
+}
+#else
+static bool satcc_coupled(struct sock *sk)
+{
+	return false;
+}
+
+static u32 coupled_throughput(struct sock *sk)
+{
+	return 0;
+}
+
+static u32 coupled_increase(struct sock *sk, u32 a)
+{
+	return a;
+}
+#endif
+
+static u32 group_key(struct sock *sk, u8 mode)
+{
+	struct dst_entry *dst;
+
+	if (mode == GROUP_DEVICE)
+	{
+		dst = __sk_dst_get(sk);
+		return dst && dst->dev ? dst->dev->ifindex : 0;
+	}
+	return satcc_peer_key(sk, group_prefix);
+}
+
+// called from init, may run in softirq
+static void group_join(struct sock *sk)
+{
+	struct Q_cong *qc = inet_csk_ca(sk);
+	struct satcc_group *g, *new;
+	struct hlist_head *head;
+	u8 mode = min_t(u32, group, GROUP_DEVICE);
+	u32 key = group_key(sk, mode);
+	u32 net = net_hash_mix(sock_net(sk));
+
+	new = kzalloc(sizeof(*new), GFP_ATOMIC);
+	head = &satcc_groups[jhash_3words(key, net, sk->sk_family | mode << 16, 0) & (GROUP_HASH_SIZE - 1)];
+
+	spin_lock_bh(&satcc_group_lock);
+	hlist_for_each_entry(g, head, node)
+	{
+		if (g->key == key && g->net == net && g->family == sk->sk_family && g->mode == mode)
+			break;
+	}
+	if (!g && new)
+	{
+		g = new;
+		new = NULL;
+		g->key = key;
+		g->net = net;
+		g->family = sk->sk_family;
+		g->mode = mode;
+		hlist_add_head(&g->node, head);
+	}
+	if (g)
+		g->flows++;
+	spin_unlock_bh(&satcc_group_lock);
+
+	kfree(new);
+	qc->ext->group = g;
+}
+
+static void group_leave(struct sock *sk)
+{
+	struct Q_cong *qc = inet_csk_ca(sk);
+	struct satcc_group *g = qc->ext->group;
+
+	atomic_long_add(-(long)qc->ext->group_rate, &g->rate);
+	spin_lock_bh(&satcc_group_lock);
+	if (--g->flows == 0)
+		hlist_del(&g->node);
+	else
+		g = NULL;
+	spin_unlock_bh(&satcc_group_lock);
+	kfree(g);
+	qc->ext->group = NULL;
+}
+
+// folds this flow's last interval into the group aggregates
+static void group_update(struct sock *sk, const struct rate_sample *rs)
+{
+	struct Q_cong *qc = inet_csk_ca(sk);
+	struct satcc_group *g = qc->ext->group;
+	u32 qdelay = max_t(long, rs->rtt_us - (long)qc->min_rtt_us, 0);
+	u32 old = READ_ONCE(g->qdelay_us);
+
+	atomic_long_add((long)qc->estimated_throughput - (long)qc->ext->group_rate, &g->rate);
+	qc->ext->group_rate = qc->estimated_throughput;
+	// racy by design, a lost sample only delays the average
+	WRITE_ONCE(g->qdelay_us, old ? old - (old >> 3) + (qdelay >> 3) : qdelay);
+}
+
+static struct satcc_group *satcc_group(struct Q_cong *qc)
+{
+	return qc->ext ? qc->ext->group : NULL;
+}
+
 static int up_actions_list[8] = {30,150,750,3750,18750,93750,468750,2343750};
 static int down_actions_list[8] = {1,3,5,9,15,21,33,51};
 static void executeAction(struct sock *sk, const struct rate_sample *rs)
@@ -334,9 +1372,16 @@ static void executeAction(struct sock *sk, const struct rate_sample *rs)
 	switch (qc->action)
 	{
 	case CWND_UP:
+		// the application does not fill the current cwnd, more would not be used
+		if (qc->app_limited)
+			break;
 
 		if(tp->snd_cwnd==0) tp->snd_cwnd=1;
 		a = up_actions_list[qc->up_n] / tp->snd_cwnd;
+		if (satcc_coupled(sk))
+			a = coupled_increase(sk, a);
+		else if (satcc_group(qc))
+			a /= max_t(int, READ_ONCE(satcc_group(qc)->flows), 1);
 		if(a==0) a=1;
 		tp->snd_cwnd = tp->snd_cwnd + a;
 
@@ -384,65 +1429,209 @@ static void executeAction(struct sock *sk, const struct rate_sample *rs)
 
 }
 
+/*
+ * Loss recovery. With cong_control the kernel leaves cwnd to us during
+ * recovery, so the agent stands aside: fast recovery runs proportional
+ * rate reduction (RFC 6937) from the cwnd before the loss down to
+ * ssthresh, an RTO recovers with packet conservation plus slow start up
+ * to ssthresh, and no decision is taken until the flow is Open again.
+ * The cwnd before the loss (the pre-ProbeRTT one if it hit during
+ * ProbeRTT) is kept for undo after a spurious loss. It is saved here,
+ * as tcp_enter_loss() collapses cwnd to 1 before the state changes.
+ */
+static u32 q_cong_ssthresh(struct sock *sk)
+{
+	struct tcp_sock *tp = tcp_sk(sk);
+	struct Q_cong *qc = inet_csk_ca(sk);
+
+	if (qc->ext)
+		qc->ext->loss_cwnd = qc->mode == ESTIMATE_MIN_RTT ? max_t(u32, qc->prior_cwnd, tp->snd_cwnd) : tp->snd_cwnd;
+	return max_t(u32, (u64)tp->snd_cwnd * min_t(u32, recovery_beta, 1024) >> 10, 2);
+}
+
+static void q_cong_set_state(struct sock *sk, u8 new_state)
+{
+	struct Q_cong *qc = inet_csk_ca(sk);
+
+	if (new_state >= TCP_CA_Recovery)
+		qc->recovery = 1;
+}
+
+static void recovery_cwnd(struct sock *sk, const struct rate_sample *rs)
+{
+	struct tcp_sock *tp = tcp_sk(sk);
+	int delta;
+	int sndcnt;
+
+	if (inet_csk(sk)->icsk_ca_state == TCP_CA_Loss)
+	{
+		tp->snd_cwnd = max(tp->snd_cwnd, tcp_packets_in_flight(tp) + rs->acked_sacked);
+		if (tp->snd_cwnd < tp->snd_ssthresh)
+			tp->snd_cwnd = min(tp->snd_cwnd + rs->acked_sacked, tp->snd_ssthresh);
+		return;
+	}
+
+	// tcp_init_cwnd_reduction() set prior_cwnd, ssthresh and cleared both PRR counters
+	tp->prr_delivered += rs->acked_sacked;
+	delta = tp->snd_ssthresh - tcp_packets_in_flight(tp);
+	if (delta < 0)
+		sndcnt = DIV_ROUND_UP((u64)tp->prr_delivered * tp->snd_ssthresh, max_t(u32, tp->prior_cwnd, 1)) - tp->prr_out;
+	else
+		sndcnt = min_t(int, delta, max_t(int, tp->prr_delivered - tp->prr_out, rs->acked_sacked) + 1);	// PRR-SSRB
+	sndcnt = max(sndcnt, tp->prr_out ? 0 : 1);
+	tp->snd_cwnd = tcp_packets_in_flight(tp) + max(sndcnt, 0);
+}
+
 static u32 q_cong_undo_cwnd(struct sock *sk)
 {
 	struct tcp_sock *tp = tcp_sk(sk);
+	struct Q_cong *qc = inet_csk_ca(sk);
+
+	// without ext, tcp_enter_loss() and tcp_init_cwnd_reduction() saved it in prior_cwnd
+	return max(tp->snd_cwnd, qc->ext ? qc->ext->loss_cwnd : tp->prior_cwnd);
+}
 
-	return max(tp->snd_cwnd, tp->prior_cwnd);
+/*
+ * Decision cadence. The interval is cadence_rounds min RTTs of wall time
+ * or RTT rounds (a round ends when a packet sent after it began is
+ * delivered), times the flow's cadence_scale in quarters. With
+ * cadence_adaptive the scale halves when the throughput or delay state
+ * moves by more than one bin and grows by a quarter per decision that
+ * keeps it, so transients get fast control and steady state few
+ * decisions. Rates and the retransmission count are normalized to the
+ * nominal interval, which keeps rewards comparable across lengths.
+ */
+#define CADENCE_NOMINAL 4	// scale in quarters of the nominal interval
+#define CADENCE_MIN 2
+#define CADENCE_MAX 16
+
+static u32 base_interval_ms(struct Q_cong *qc)
+{
+	return max_t(u32, cadence_rounds, 1) * (qc->min_rtt_us >> 10);
 }
 
 static void calc_retransmit_during_interval(struct sock *sk)
 {
 	struct tcp_sock *tp = tcp_sk(sk);
 	struct Q_cong *qc = inet_csk_ca(sk);
-	u32 training_interval_msec;
-	training_interval_msec = 2 * (qc->min_rtt_us>>10); //2RTT
+	u32 interval_ms = max_t(u32, jiffies_to_msecs(tcp_jiffies32 - qc->last_update_stamp), 1);
 
-	qc->retransmit_during_interval = (tp->total_retrans - qc->last_packet_loss) * training_interval_msec / jiffies_to_msecs(tcp_jiffies32 - qc->last_update_stamp);
+	// per nominal interval, whatever the cadence made this one
+	if (qc->ext)
+		qc->ext->interval_ms = interval_ms;
+	qc->retransmit_during_interval = (tp->total_retrans - qc->last_packet_loss) * base_interval_ms(qc) / interval_ms;
 	qc->last_packet_loss = tp->total_retrans;
 }
 
+// CE-marked fraction since the last decision, 0 without ECN
+static void calc_ce_fraction(struct sock *sk)
+{
+	struct Q_cong *qc = inet_csk_ca(sk);
+	struct Q_cong_ext *ext = qc->ext;
+
+	if (!ext)
+		return;
+	ext->ce_frac = ext->ce_acked ? ((u32)ext->ce_marked << 10) / ext->ce_acked : 0;
+	ext->ce_acked = 0;
+	ext->ce_marked = 0;
+}
+
 static void calc_throughput(struct sock *sk)
 {
 	struct tcp_sock *tp = tcp_sk(sk);
 	struct Q_cong *qc = inet_csk_ca(sk);
 	u8 i;
-	u32 segout_for_interval;
+	u64 segout_for_interval;
+	u32 interval_ms;
 
-	segout_for_interval = (tp->segs_out - qc->last_sequence) * tp->mss_cache;
+	segout_for_interval = (u64)(tp->segs_out - qc->last_sequence) * tp->mss_cache;
+	interval_ms = max_t(u32, jiffies_to_msecs(tcp_jiffies32 - qc->last_update_stamp), 1);
 
-	qc->estimated_throughput = segout_for_interval * 8 / jiffies_to_msecs(tcp_jiffies32 - qc->last_update_stamp);
+	// kbit/s, u32 holds up to 4 Tbit/s
+	qc->estimated_throughput = min_t(u64, div_u64(segout_for_interval * 8, interval_ms), U32_MAX);
+	qc->last_sequence = tp->segs_out;
+
+	// an app-limited rate says nothing about the path unless it is higher: keep state and filters
+	if (qc->app_limited && qc->estimated_throughput < rate_history_mean(qc))
+	{
+		qc->estimated_throughput = rate_history_mean(qc);
+		return;
+	}
 
 	for (i = 0; i < 4; i++)
 		qc->last_throughput_mean[i] = qc->last_throughput_mean[i+1];
-	if((qc->estimated_throughput>>5)<65535) 	//u16
-		qc->last_throughput_mean[4] = qc->estimated_throughput>>5;
-	else
-		qc->last_throughput_mean[4] = 65534;
+	qc->last_throughput_mean[4] = rate_pack(qc->estimated_throughput);
 
 	// smooth_throughput
 	if(qc->smooth_throughput==0) qc->smooth_throughput=qc->estimated_throughput; //first time
 	qc->smooth_throughput = (qc->smooth_throughput - (qc->smooth_throughput>>3)) + (qc->estimated_throughput>>3);
 
-	qc->last_sequence = tp->segs_out;
+}
 
+// smoothed change of srtt per unit of time since the last decision, in 1/1024
+static void calc_rtt_gradient(struct sock *sk)
+{
+	struct tcp_sock *tp = tcp_sk(sk);
+	struct Q_cong *qc = inet_csk_ca(sk);
+	u32 srtt_us = tp->srtt_us >> 3;
+	u32 interval_us = jiffies_to_usecs(tcp_jiffies32 - qc->last_update_stamp);
+	s64 grad;
+
+	if (!qc->ext)
+		return;
+	if (qc->ext->last_srtt_us && interval_us)
+	{
+		grad = div_s64((s64)(s32)(srtt_us - qc->ext->last_srtt_us) << 10, interval_us);
+		grad = clamp_t(s64, grad, -S16_MAX, S16_MAX);
+		qc->ext->rtt_grad += ((int)grad - qc->ext->rtt_grad) / 4;
+	}
+	qc->ext->last_srtt_us = srtt_us;
+}
+
+// third state axis, see satcc_qtable.h
+static u16 feature_bin(struct Q_cong *qc)
+{
+	int ce = qc->ext ? min_t(u32, qc->ext->ce_frac * SATCC_CE_BINS >> 10, SATCC_CE_BINS - 1) : 0;
+	int grad = SATCC_GRAD_BINS / 2;
+
+	if (qc->ext && rtt_grad_step)
+		grad += qc->ext->rtt_grad / (int)rtt_grad_step;
+	grad = clamp_t(int, grad, 0, SATCC_GRAD_BINS - 1);
+
+	return ce * SATCC_GRAD_BINS + grad;
+}
+
+static u16 throughput_bin(struct satcc_params *p, u32 kbps)
+{
+	if (p->rate_bins == RATE_BINS_LOG)
+		return min_t(u32, log2_8(kbps), state0_max - 1);
+	return min_t(u32, kbps >> 9, state0_max - 1);	// 240 -> 0-120Mbps
 }
 
 static void update_state(struct sock *sk, const struct rate_sample *rs)
 {	
 	// struct tcp_sock *tp = tcp_sk(sk);
 	struct Q_cong *qc = inet_csk_ca(sk);
+	struct satcc_params *p = satcc_pernet(sock_net(sk))->p;
 	u8 i;
 	int delay;
 
 	for (i = 0; i < numOfState; i++)
 		qc->prev_state[i] = qc->current_state[i];
 
-	qc->current_state[0] = qc->estimated_throughput>>9; // 240 -> 0-120Mbps
+	if (satcc_coupled(sk))
+		qc->current_state[0] = throughput_bin(p, coupled_throughput(sk));
+	else if (satcc_group(qc))
+		qc->current_state[0] = throughput_bin(p, min_t(long, atomic_long_read(&satcc_group(qc)->rate), U32_MAX));
+	else
+		qc->current_state[0] = throughput_bin(p, qc->estimated_throughput);
 
-	qc->current_state[2] = 0;	// third axis
+	qc->current_state[2] = feature_bin(qc);	// third axis
 
-	qc->current_state[1] = (rs->rtt_us - qc->min_rtt_us) >> 13;   // 100 -> 0-800ms
+	if (satcc_group(qc))
+		qc->current_state[1] = min_t(u32, READ_ONCE(satcc_group(qc)->qdelay_us) >> 13, state1_max - 1);
+	else
+		qc->current_state[1] = min_t(long, max_t(long, rs->rtt_us - (long)qc->min_rtt_us, 0) >> 13, state1_max - 1);   // 100 -> 0-800ms
 
 	if (qc->current_state[0] < 0)
 		qc->current_state[0] = 0;
@@ -470,6 +1659,7 @@ static void update_Qtable(struct sock *sk, const struct rate_sample *rs)
 	u8 i;
 	int updated_Qvalue;
 	int max_tmp;
+	int lr;
 	for (i = 0; i < numOfAction; i++)
 	{
 		thisQ[i] = getMatValue(qc->qtable, qc->prev_state[0], qc->prev_state[1], qc->prev_state[2], i);
@@ -483,38 +1673,223 @@ static void update_Qtable(struct sock *sk, const struct rate_sample *rs)
 		if (max_tmp < newQ[i])
 			max_tmp = newQ[i];
 	}
-	updated_Qvalue = ((Q_CONG_SCALE - learning_rate) * thisQ[qc->action] +
-					  (learning_rate * (getRewardFromEnvironment(sk, rs) + ((discount_factor * max_tmp)/16)))) >>
+	lr = clamp_t(int, learning_rate, 0, Q_CONG_SCALE);
+	updated_Qvalue = ((Q_CONG_SCALE - lr) * thisQ[qc->action] +
+					  (lr * (getRewardFromEnvironment(sk, rs) + ((clamp_t(int, discount_factor, 0, 16) * max_tmp)/16)))) >>
 					 10;
 
 	setMatValue(qc->qtable, qc->prev_state[0], qc->prev_state[1], qc->prev_state[2], qc->action, updated_Qvalue);
 
 }
 
+// number of the scheduled handover slot the wall clock is in
+static u32 handover_slot(u32 period_ms)
+{
+	u64 now_ms = div_u64(ktime_get_real_ns(), NSEC_PER_MSEC);
+
+	return div_u64(now_ms - handover_phase_ms, period_ms);
+}
+
+// an abrupt step of the base RTT, or a rate step with a smaller RTT move, in the last interval
+static bool handover_detected(struct sock *sk)
+{
+	struct Q_cong *qc = inet_csk_ca(sk);
+	u32 base = qc->min_rtt_us;
+	u32 step = base / 100 * handover_rtt_pct;
+	u32 cur = qc->ext->interval_min_rtt_us;
+	u32 prev = qc->ext->prev_min_rtt_us;
+	u32 rate_step = qc->smooth_throughput / 100 * handover_rate_pct;
+	bool rate_moved;
+
+	if (cur == U32_MAX || !base)
+		return false;
+	if (cur > base + step && prev <= base + step)
+		return true;
+
+	rate_moved = qc->estimated_throughput > qc->smooth_throughput + rate_step ||
+				 qc->estimated_throughput + rate_step < qc->smooth_throughput;
+	return rate_moved && (cur > base + step / 2 || cur + step / 2 < base);
+}
+
+/*
+ * Checks for a handover at a decision. On one, min RTT is rebased to the
+ * new path, the throughput history restarts from the current estimate so
+ * state and epsilon_update() see the new link, and a short STARTUP phase
+ * re-probes the bandwidth.
+ */
+static bool handover_check(struct sock *sk, const struct rate_sample *rs)
+{
+	struct Q_cong *qc = inet_csk_ca(sk);
+	struct Q_cong_ext *ext = qc->ext;
+	bool hit = false;
+	u32 period_ms = READ_ONCE(handover_period_ms);	// may be set to 0 under us
+	u32 slot;
+	u8 i;
+
+	if (!handover || !ext)
+		return false;
+
+	if (period_ms)
+	{
+		slot = handover_slot(period_ms);
+		hit = ext->handover_slot && slot != ext->handover_slot;
+		ext->handover_slot = slot;
+	}
+	if (!hit)
+		hit = handover_detected(sk);
+
+	ext->prev_min_rtt_us = ext->interval_min_rtt_us;
+	ext->interval_min_rtt_us = U32_MAX;
+	if (!hit)
+		return false;
+
+	handovers++;
+	if (ext->prev_min_rtt_us != U32_MAX)
+		qc->min_rtt_us = ext->prev_min_rtt_us;
+	if (rs->rtt_us > 0 && rs->rtt_us < qc->min_rtt_us)
+		qc->min_rtt_us = rs->rtt_us;
+	qc->last_probertt_stamp = tcp_jiffies32;
+
+	qc->smooth_throughput = qc->estimated_throughput;
+	for (i = 0; i < 5; i++)
+		qc->last_throughput_mean[i] = rate_pack(qc->estimated_throughput);
+	qc->epsilon_step = 0;
+	qc->epsilon_count = 0;
+	ext->rtt_grad = 0;
+	ext->last_srtt_us = 0;
+
+	if (handover_probe_ms && handover_probe_ms < 2000)
+	{
+		qc->mode = STARTUP;
+		qc->start_up_stamp = tcp_jiffies32 - msecs_to_jiffies(2000 - handover_probe_ms);
+	}
+	return true;
+}
+
+static bool decision_due(struct sock *sk, const struct rate_sample *rs)
+{
+	struct tcp_sock *tp = tcp_sk(sk);
+	struct Q_cong *qc = inet_csk_ca(sk);
+	u32 scale = qc->ext ? qc->ext->cadence_scale : CADENCE_NOMINAL;
+
+	if (cadence && qc->ext)
+	{
+		if (!before(rs->prior_delivered, qc->ext->round_delivered))
+		{
+			qc->ext->round_delivered = tp->delivered;
+			if (qc->ext->rounds < U8_MAX)
+				qc->ext->rounds++;
+		}
+		return qc->ext->rounds * CADENCE_NOMINAL >= max_t(u32, cadence_rounds, 1) * scale;
+	}
+	return after(tcp_jiffies32, qc->last_update_stamp + msecs_to_jiffies(base_interval_ms(qc) * scale / CADENCE_NOMINAL));
+}
+
+// called once current_state holds the new state
+static void cadence_adapt(struct Q_cong *qc)
+{
+	u32 scale;
+
+	if (!qc->ext)
+		return;
+	scale = qc->ext->cadence_scale;
+	if (!cadence_adaptive)
+		scale = CADENCE_NOMINAL;
+	else if (abs(qc->current_state[0] - qc->prev_state[0]) > 1 || abs(qc->current_state[1] - qc->prev_state[1]) > 1)
+		scale = max_t(u32, scale / 2, CADENCE_MIN);
+	else
+		scale = min_t(u32, scale + 1, CADENCE_MAX);
+	qc->ext->cadence_scale = scale;
+}
+
 static void training(struct sock *sk, const struct rate_sample *rs)
 {
 	struct Q_cong *qc = inet_csk_ca(sk);
-	u32 training_interval_msec;
 	u32 training_timer_expired;
-	training_interval_msec = 2 * (qc->min_rtt_us>>10); //2RTT
+	bool moved;
+	u64 t;
+
+	training_timer_expired = decision_due(sk, rs);
 
-	training_timer_expired = after(tcp_jiffies32, qc->last_update_stamp + msecs_to_jiffies(training_interval_msec));
+	// recovery_cwnd() owns cwnd until the flow is Open again
+	if (inet_csk(sk)->icsk_ca_state >= TCP_CA_Recovery)
+		return;
 
 	if (training_timer_expired && qc->mode == NOTHING)
 	{
-		if (qc->action == 0xffffffff)
+		// no action taken yet (action is a u8, -1 reads back as 255)
+		if (qc->action >= numOfAction)
 			goto execute;
 
+		t = lat_start();
 		calc_throughput(sk);
+		calc_ce_fraction(sk);
+		calc_rtt_gradient(sk);
+		if (satcc_group(qc))
+			group_update(sk, rs);
+		moved = handover_check(sk, rs);
 		update_state(sk, rs);
+		cadence_adapt(qc);
 		calc_retransmit_during_interval(sk);
+		lat_end(STAGE_STATE, t);
+
+		// the interval spanning a handover says nothing about the action taken
+		if (moved)
+		{
+			if (qc->mode == STARTUP)
+			{
+				// decisions resume once the re-probe ends
+				qc->action = -1;
+				qc->last_update_stamp = tcp_jiffies32;
+				return;
+			}
+			goto execute;
+		}
+
+		// the decision before an idle gap was not measured
+		if (qc->idle)
+		{
+			qc->idle = 0;
+			goto execute;
+		}
+
+		// an under-driven interval does not show what the action did
+		if (qc->app_limited)
+			goto execute;
 
-		update_Qtable(sk, rs);
+		// cwnd followed PRR rather than the action for part of the interval
+		if (qc->recovery)
+		{
+			recovery_intervals++;
+			if (recovery_skip_updates)
+				goto execute;
+		}
+
+		// shared replicas are read-only, only private copies adapt
+		if (qc->qtable)
+		{
+			t = lat_start();
+			update_Qtable(sk, rs);
+			lat_end(STAGE_UPDATE, t);
+		}
 	execute:
+		// applications may set or change their target at any time
+		if (qc->ext)
+			qc->ext->delay_target_us = slo_target_us(sk);
 		// printk(KERN_INFO "execute Action: %u", qc -> action);
+		t = lat_start();
 		qc->action = getAction(sk, rs);
+		lat_end(STAGE_ACTION, t);
+		if (shadow_arm)
+			shadow_compare(sk);
+		t = lat_start();
 		executeAction(sk, rs);
+		lat_end(STAGE_EXECUTE, t);
 		qc->last_update_stamp = tcp_jiffies32;
+		qc->app_limited = 0;
+		qc->recovery = 0;
+		if (qc->ext)
+			qc->ext->rounds = 0;
 		
 		epsilon_update(sk, rs);
 	}
@@ -531,6 +1906,8 @@ static void update_min_rtt(struct sock *sk, const struct rate_sample *rs)
 
 	if (rs->rtt_us > 0)
 	{
+		if (qc->ext && rs->rtt_us < qc->ext->interval_min_rtt_us)
+			qc->ext->interval_min_rtt_us = rs->rtt_us;
 		if (rs->rtt_us < qc->min_rtt_us)
 		{
 			qc->min_rtt_us = rs->rtt_us;
@@ -542,6 +1919,10 @@ static void update_min_rtt(struct sock *sk, const struct rate_sample *rs)
 		}
 	}
 
+	// ProbeRTT neither starts nor ends while recovery_cwnd() owns cwnd
+	if (inet_csk(sk)->icsk_ca_state >= TCP_CA_Recovery)
+		return;
+
 	if (update_filter_expired && qc->mode == NOTHING)
 	{
 		qc->mode = ESTIMATE_MIN_RTT;
@@ -574,7 +1955,7 @@ static void reset_cwnd(struct sock *sk, const struct rate_sample *rs){
 		if(inet_csk(sk) -> icsk_ca_state >= TCP_CA_Recovery){
 			qc -> mode = NOTHING; 
 		}
-		else{
+		else if (tcp_is_cwnd_limited(sk)){
 			tp -> snd_cwnd += rs -> acked_sacked;
 		}
 	}
@@ -584,28 +1965,207 @@ static void reset_cwnd(struct sock *sk, const struct rate_sample *rs){
 	}
 }
 
-static void q_cong_main(struct sock *sk, const struct rate_sample *rs)
-{
-	reset_cwnd(sk, rs);
-	training(sk, rs);
-	update_min_rtt(sk, rs);
-}
-
-static void init_Q_cong(struct sock *sk)
+/*
+ * Sending resumes with nothing in flight. After an application idle
+ * period longer than a decision interval the measurement window would
+ * span the gap and read as a near-zero rate, so rebase it on the restart
+ * and skip the Q update of the decision taken before the gap. The cwnd is
+ * kept (cong_control flows are exempt from slow start after idle), and an
+ * idle pipe has drained its queue, so the gap also counts as an RTT probe.
+ */
+static void q_cong_cwnd_event(struct sock *sk, enum tcp_ca_event event)
 {
-	struct Q_cong *qc;
 	struct tcp_sock *tp = tcp_sk(sk);
-	u16 Q_row[numOfState] = {state0_max, state1_max, state2_max};
-	u16 Q_col = numOfAction;
+	struct Q_cong *qc = inet_csk_ca(sk);
+	u32 now = tcp_jiffies32;
+	u32 idle_ms;
 
-	qc = inet_csk_ca(sk);
+	if (event != CA_EVENT_TX_START || qc->mode != NOTHING)
+		return;
 
-	qc->mode = STARTUP;
-	qc->up_times = 0;
-	qc->down_times = 0;
+	// lsndtime is still the last send before the gap
+	idle_ms = jiffies_to_msecs(now - tp->lsndtime);
+	if (idle_ms <= max_t(u32, base_interval_ms(qc), 1))
+		return;
+
+	qc->idle = 1;
+	qc->last_update_stamp = now;
+	qc->last_sequence = tp->segs_out;
+	qc->last_packet_loss = tp->total_retrans;
+	if (qc->ext)
+	{
+		qc->ext->ce_acked = 0;
+		qc->ext->ce_marked = 0;
+		qc->ext->last_srtt_us = 0;
+		qc->ext->interval_min_rtt_us = U32_MAX;
+	}
+	if (idle_ms >= max_probertt_duration_msecs)
+		qc->last_probertt_stamp = now;
+}
+
+// tcp_ack() reports the ACK's flags before calling cong_control
+static void q_cong_in_ack_event(struct sock *sk, u32 flags)
+{
+	struct Q_cong *qc = inet_csk_ca(sk);
+
+	qc->ece = !!(flags & CA_ACK_ECE);
+}
+
+static void count_ce(struct sock *sk, const struct rate_sample *rs)
+{
+	struct Q_cong *qc = inet_csk_ca(sk);
+	struct Q_cong_ext *ext = qc->ext;
+	u32 acked = rs->acked_sacked;
+
+	if (ext)
+	{
+		// saturate both counters together to keep the fraction
+		if (ext->ce_acked + acked > 0xffff)
+		{
+			ext->ce_acked >>= 1;
+			ext->ce_marked >>= 1;
+			acked = min_t(u32, acked, 0x7fff);
+		}
+		ext->ce_acked += acked;
+		if (qc->ece)
+			ext->ce_marked += acked;
+	}
+	qc->ece = 0;
+}
+
+static void q_cong_main(struct sock *sk, const struct rate_sample *rs)
+{
+	struct Q_cong *qc = inet_csk_ca(sk);
+	u64 t = lat_start();
+
+	if (ecn)
+		count_ce(sk, rs);
+	// an interval is app-limited once a sample is and cwnd was not filled
+	if (rs->is_app_limited && !tcp_is_cwnd_limited(sk))
+		qc->app_limited = 1;
+	reset_cwnd(sk, rs);
+	training(sk, rs);
+	if (inet_csk(sk)->icsk_ca_state >= TCP_CA_Recovery)
+		recovery_cwnd(sk, rs);
+	slo_cap(sk, rs);
+	update_min_rtt(sk, rs);
+	lat_end(STAGE_MAIN, t);
+}
+
+static u32 warm_cache_key(struct sock *sk)
+{
+	return satcc_peer_key(sk, warm_prefix);
+}
+
+static struct warm_entry __rcu **warm_cache_slot(u32 key, u32 net, u16 family)
+{
+	return &warm_cache[jhash_3words(key, net, family, 0) & (WARM_CACHE_SIZE - 1)];
+}
+
+// seed a new flow with min RTT, rate, cwnd and exploration state of the last flow to its prefix
+static void warm_cache_lookup(struct sock *sk)
+{
+	struct tcp_sock *tp = tcp_sk(sk);
+	struct Q_cong *qc = inet_csk_ca(sk);
+	struct warm_entry *e;
+	u32 key = warm_cache_key(sk);
+	u32 net = net_hash_mix(sock_net(sk));
+	u8 i;
+
+	rcu_read_lock();
+	e = rcu_dereference(*warm_cache_slot(key, net, sk->sk_family));
+	if (e && e->key == key && e->net == net && e->family == sk->sk_family &&
+		!after(tcp_jiffies32, e->stamp + msecs_to_jiffies(warm_ttl_sec * 1000)))
+	{
+		if (qc->min_rtt_us == ~0U)
+		{
+			qc->min_rtt_us = e->min_rtt_us;
+			qc->prop_rtt_us = e->min_rtt_us;
+		}
+		qc->estimated_throughput = e->throughput;
+		qc->smooth_throughput = e->throughput;
+		for (i = 0; i < 5; i++)
+			qc->last_throughput_mean[i] = rate_pack(e->throughput);
+		qc->epsilon_step = e->epsilon_step;
+
+		// snd_cwnd_clamp may be below TCP_INIT_CWND with a small TCP_WINDOW_CLAMP
+		tp->snd_cwnd = min_t(u32, max_t(u32, e->cwnd * warm_cwnd_pct / 100, TCP_INIT_CWND), tp->snd_cwnd_clamp);
+		qc->mode = NOTHING;	// already near the operating point, skip STARTUP
+	}
+	rcu_read_unlock();
+}
+
+static void warm_cache_update(struct sock *sk)
+{
+	struct tcp_sock *tp = tcp_sk(sk);
+	struct Q_cong *qc = inet_csk_ca(sk);
+	struct warm_entry __rcu **slot;
+	struct warm_entry *e;
+	struct warm_entry *old;
+
+	// nothing learned yet
+	if (qc->min_rtt_us == ~0U || qc->min_rtt_us == 0 || qc->estimated_throughput == 0)
+		return;
+
+	e = kmalloc(sizeof(*e), GFP_ATOMIC);
+	if (!e)
+		return;
+
+	e->key = warm_cache_key(sk);
+	e->net = net_hash_mix(sock_net(sk));
+	e->family = sk->sk_family;
+	e->epsilon_step = qc->epsilon_step;
+	e->stamp = tcp_jiffies32;
+	e->min_rtt_us = qc->min_rtt_us;
+	e->throughput = qc->smooth_throughput;
+	e->cwnd = qc->mode == ESTIMATE_MIN_RTT ? qc->prior_cwnd : tp->snd_cwnd;
+
+	slot = warm_cache_slot(e->key, e->net, e->family);
+	spin_lock_bh(&warm_cache_lock);
+	old = rcu_dereference_protected(*slot, lockdep_is_held(&warm_cache_lock));
+	rcu_assign_pointer(*slot, e);
+	spin_unlock_bh(&warm_cache_lock);
+
+	if (old)
+		kfree_rcu(old, rcu);
+}
+
+static void warm_cache_flush(void)
+{
+	struct warm_entry *e;
+	u32 i;
+
+	for (i = 0; i < WARM_CACHE_SIZE; i++)
+	{
+		e = rcu_dereference_protected(warm_cache[i], 1);
+		RCU_INIT_POINTER(warm_cache[i], NULL);
+		kfree(e);
+	}
+	rcu_barrier();
+}
+
+static void init_Q_cong(struct sock *sk)
+{
+	struct Q_cong *qc;
+	struct satcc_net *sn;
+	Matrix *table;
+	struct tcp_sock *tp = tcp_sk(sk);
+	u16 Q_row[numOfState] = {state0_max, state1_max, state2_max};
+	u16 Q_col = numOfAction;
+
+	qc = inet_csk_ca(sk);
+
+	qc->mode = STARTUP;
+	qc->up_times = 0;
+	qc->down_times = 0;
 	qc->up_n = 0;
 	qc->epsilon_step = 0;
 	qc->epsilon_count = 0;
+	qc->explore_count = 0;
+	qc->ece = 0;
+	qc->idle = 0;
+	qc->app_limited = 0;
+	qc->recovery = 0;
 	qc->last_sequence = 0;
 	qc->estimated_throughput = 0;
 
@@ -619,7 +2179,6 @@ static void init_Q_cong(struct sock *sk)
 	qc->last_packet_loss = 0;
 	qc->start_up_stamp = tcp_jiffies32;
 
-    qc -> throughput_count = 0;
 	qc -> smooth_throughput = 0;
 
 	qc->last_probertt_stamp = tcp_jiffies32;
@@ -637,27 +2196,677 @@ static void init_Q_cong(struct sock *sk)
 	qc->current_state[1] = 0;
 	qc->current_state[2] = 0;
 
+	// init may run in softirq for passive opens
+	qc->ext = kzalloc(sizeof(*qc->ext), GFP_ATOMIC);
+	if (qc->ext)
+	{
+		qc->ext->interval_min_rtt_us = U32_MAX;
+		qc->ext->prev_min_rtt_us = U32_MAX;
+		qc->ext->cadence_scale = CADENCE_NOMINAL;
+		qc->ext->start_stamp = tcp_jiffies32;
+		if (group)
+			group_join(sk);
+	}
+
+	if (warm_start)
+		warm_cache_lookup(sk);
+
+	qc->arm = satcc_pick_arm(sk);
+	if (qc->ext)
+	{
+		qc->ext->delay_target_us = slo_target_us(sk);
+		if (qc->ext->delay_target_us && slo_arm && slo_arm < SATCC_ARMS &&
+			rcu_access_pointer(arm_tables[slo_arm]))
+			qc->arm = slo_arm;
+	}
+	qc->qtable = NULL;
+	if (share_table)
+		return;
+
 	qc->qtable = (Matrix *)kvmalloc( sizeof(Matrix), GFP_KERNEL);
 	if (!qc->qtable){
 		printk(KERN_INFO "init qtable error");
         return;
 	}
-	else{
-		memcpy(qc->qtable, &matrix, sizeof(Matrix));
+	if (qc->arm){
+		rcu_read_lock();
+		table = satcc_flow_table(sk, qc->arm);
+		if (table)
+			memcpy(qc->qtable, table, sizeof(Matrix));
+		rcu_read_unlock();
+		if (table)
+			return;
 	}
+	// the namespace table, also when the arm's copy could not be read
+	sn = satcc_table_owner(sock_net(sk));
+	read_lock_bh(&sn->lock);
+	memcpy(qc->qtable, sn->matrix, sizeof(Matrix));
+	read_unlock_bh(&sn->lock);
+}
+
+static void satcc_ab_account(struct sock *sk)
+{
+	struct tcp_sock *tp = tcp_sk(sk);
+	struct Q_cong *qc = inet_csk_ca(sk);
+	atomic64_t *st = ab_stats[qc->arm];
+	u32 fct_ms;
+	u64 kbps;
+	u32 inflation;
+
+	// flows that never delivered data would only dilute the arm
+	if (!qc->ext || !tp->bytes_acked)
+		return;
+	fct_ms = max_t(u32, jiffies_to_msecs(tcp_jiffies32 - qc->ext->start_stamp), 1);
+	kbps = div_u64(tp->bytes_acked * 8, fct_ms);
+	inflation = tcp_min_rtt(tp) && tcp_min_rtt(tp) != ~0U ? (tp->srtt_us >> 3) * 100 / tcp_min_rtt(tp) : 100;
+
+	atomic64_inc(&st[AB_FLOWS]);
+	atomic64_add(kbps, &st[AB_GOODPUT_KBPS]);
+	atomic64_add((kbps >> 10) * (kbps >> 10), &st[AB_GOODPUT_SQ]);
+	atomic64_add(inflation, &st[AB_RTT_INFLATION]);
+	atomic64_add((u64)inflation * inflation, &st[AB_RTT_INFLATION_SQ]);
+	atomic64_add(tp->total_retrans, &st[AB_RETRANS]);
+	atomic64_add(tp->segs_out, &st[AB_SEGS_OUT]);
+	atomic64_add(fct_ms, &st[AB_FCT_MS]);
+	atomic64_add((u64)fct_ms * fct_ms, &st[AB_FCT_SQ]);
 }
 
 static void release_Q_cong(struct sock *sk)
 {	
 	struct Q_cong *qc = inet_csk_ca(sk);
+
+	if (net_eq(sock_net(sk), &init_net))
+		satcc_ab_account(sk);
+	if (satcc_group(qc))
+		group_leave(sk);
+	kfree(qc->ext);
+	qc->ext = NULL;
+
+	if (warm_start)
+		warm_cache_update(sk);
+
 	if(qc->qtable){
 		kvfree(qc->qtable);
-	}else{
+	}else if (!share_table){
 		printk(KERN_INFO "qc table is null");
 	}
 	// eraseMatrix();
 }
 
+static struct ctl_table satcc_sysctl_table[] = {
+	{ .procname = "explore", .data = &satcc_defaults.explore, .maxlen = sizeof(unsigned int), .mode = 0644, .proc_handler = proc_douintvec },
+	{ .procname = "explore_budget", .data = &satcc_defaults.explore_budget, .maxlen = sizeof(unsigned int), .mode = 0644, .proc_handler = proc_douintvec },
+	{ .procname = "reward", .data = &satcc_defaults.reward, .maxlen = sizeof(unsigned int), .mode = 0644, .proc_handler = proc_douintvec },
+	{ .procname = "alpha", .data = &satcc_defaults.alpha, .maxlen = sizeof(unsigned int), .mode = 0644, .proc_handler = proc_douintvec },
+	{ .procname = "beta", .data = &satcc_defaults.beta, .maxlen = sizeof(unsigned int), .mode = 0644, .proc_handler = proc_douintvec },
+	{ .procname = "gamma", .data = &satcc_defaults.gamma, .maxlen = sizeof(unsigned int), .mode = 0644, .proc_handler = proc_douintvec },
+	{ .procname = "delay_target_ms", .data = &satcc_defaults.delay_target_ms, .maxlen = sizeof(unsigned int), .mode = 0644, .proc_handler = proc_douintvec },
+	{ .procname = "rate_bins", .data = &satcc_defaults.rate_bins, .maxlen = sizeof(unsigned int), .mode = 0644, .proc_handler = proc_douintvec },
+	{ .procname = "ce_weight", .data = &satcc_defaults.ce_weight, .maxlen = sizeof(unsigned int), .mode = 0644, .proc_handler = proc_douintvec },
+	{ .procname = "explorations", .data = &satcc_defaults.explorations.counter, .maxlen = sizeof(int), .mode = 0444, .proc_handler = proc_dointvec },
+	{ }
+};
+
+#define QTABLE_FILE_MAX (sizeof(struct qtable_meta) + sizeof(Matrix) + sizeof(u16) * sizeOfMatrix)
+
+/*
+ * /proc/net/satcc_qtable: reading returns the namespace's active table with
+ * metadata, writing a table file (with or without metadata) loads it for
+ * new flows of the namespace.
+ */
+struct satcc_qtable_file
+{
+	struct net *net;
+	int arm;		// load into this experiment arm instead, init_net only
+	size_t len;
+	bool loaded;
+	char buf[] __aligned(8);
+};
+
+// arms run with the parameters of init_net, only the table differs
+static int satcc_load_arm(struct satcc_qtable_file *f, struct qtable_meta *meta, Matrix *m)
+{
+	Matrix *table, *old;
+
+	if (meta && !!(meta->flags & QTABLE_LOG_RATE) != (satcc_defaults.rate_bins == RATE_BINS_LOG))
+		return -EINVAL;
+
+	table = vmalloc(sizeof(Matrix));
+	if (!table)
+		return -ENOMEM;
+	memcpy(table, m, sizeof(Matrix));
+
+	mutex_lock(&satcc_table_mutex);
+	old = rcu_dereference_protected(arm_tables[f->arm], lockdep_is_held(&satcc_table_mutex));
+	rcu_assign_pointer(arm_tables[f->arm], table);
+	mutex_unlock(&satcc_table_mutex);
+	if (old)
+	{
+		synchronize_rcu();
+		vfree(old);
+	}
+
+	f->loaded = true;
+	return 0;
+}
+
+static int satcc_load_table(struct satcc_qtable_file *f)
+{
+	struct satcc_net *sn = satcc_pernet(f->net);
+	struct qtable_meta *meta = (struct qtable_meta *)f->buf;
+	Matrix *m;
+	Matrix *table;
+	size_t offset = 0;
+
+	if (f->len < sizeof(u32))
+		return 0;
+	if (meta->magic == QTABLE_MAGIC)
+	{
+		if (f->len < sizeof(*meta))
+			return 0;
+		if (meta->size < offsetof(struct qtable_meta, reserved) || meta->size > sizeof(*meta) ||
+			meta->size % sizeof(u32))
+			return -EINVAL;
+		offset = meta->size;
+	}
+	if (f->len < offset + sizeof(Matrix))
+		return 0;
+
+	m = (Matrix *)(f->buf + offset);
+	if (!matrix_layout_ok(m))
+		return -EINVAL;
+
+	if (f->arm)
+		return satcc_load_arm(f, offset ? meta : NULL, m);
+
+	mutex_lock(&satcc_table_mutex);
+	table = sn->matrix;
+	if (!table)
+	{
+		table = vmalloc(sizeof(Matrix));
+		if (!table)
+		{
+			mutex_unlock(&satcc_table_mutex);
+			return -ENOMEM;
+		}
+	}
+	// replicas go first, a namespace with a table always has them
+	if (satcc_replicas_refresh(sn, m))
+	{
+		if (!sn->matrix)
+			vfree(table);
+		mutex_unlock(&satcc_table_mutex);
+		return -ENOMEM;
+	}
+	write_lock_bh(&sn->lock);
+	memcpy(table, m, sizeof(Matrix));
+	write_unlock_bh(&sn->lock);
+	smp_store_release(&sn->matrix, table);
+	if (offset)
+		adopt_meta(sn->p, sn->p, meta);
+	mutex_unlock(&satcc_table_mutex);
+
+	f->loaded = true;
+	return 0;
+}
+
+static int satcc_qtable_open(struct inode *inode, struct file *file)
+{
+	struct satcc_qtable_file *f;
+	struct satcc_net *sn;
+
+	f = vzalloc(sizeof(*f) + QTABLE_FILE_MAX);
+	if (!f)
+		return -ENOMEM;
+	f->net = PDE_DATA(inode);
+
+	if (!(file->f_mode & FMODE_WRITE))
+	{
+		sn = satcc_table_owner(f->net);
+		fill_meta((struct qtable_meta *)f->buf, satcc_pernet(f->net)->p);
+		read_lock_bh(&sn->lock);
+		memcpy(f->buf + sizeof(struct qtable_meta), sn->matrix, sizeof(Matrix));
+		read_unlock_bh(&sn->lock);
+		f->len = sizeof(struct qtable_meta) + sizeof(Matrix);
+	}
+
+	file->private_data = f;
+	return 0;
+}
+
+static ssize_t satcc_qtable_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
+{
+	struct satcc_qtable_file *f = file->private_data;
+
+	if (file->f_mode & FMODE_WRITE)
+		return -EINVAL;
+	return simple_read_from_buffer(buf, count, ppos, f->buf, f->len);
+}
+
+static ssize_t satcc_qtable_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+	struct satcc_qtable_file *f = file->private_data;
+	ssize_t res;
+	int err;
+
+	res = simple_write_to_buffer(f->buf, QTABLE_FILE_MAX, ppos, buf, count);
+	if (res <= 0)
+		return res;
+	f->len = max_t(size_t, f->len, *ppos);
+
+	// trailing visit counts of training tables are accepted and ignored
+	if (!f->loaded)
+	{
+		err = satcc_load_table(f);
+		if (err)
+			return err;
+	}
+	return res;
+}
+
+// close() of a write that stopped short of a whole table fails
+static int satcc_qtable_flush(struct file *file, fl_owner_t id)
+{
+	struct satcc_qtable_file *f = file->private_data;
+
+	if ((file->f_mode & FMODE_WRITE) && f->len && !f->loaded)
+		return -EINVAL;
+	return 0;
+}
+
+static int satcc_qtable_release(struct inode *inode, struct file *file)
+{
+	vfree(file->private_data);
+	return 0;
+}
+
+static const struct file_operations satcc_qtable_fops = {
+	.owner = THIS_MODULE,
+	.open = satcc_qtable_open,
+	.read = satcc_qtable_read,
+	.write = satcc_qtable_write,
+	.llseek = default_llseek,
+	.flush = satcc_qtable_flush,
+	.release = satcc_qtable_release,
+};
+
+// /proc/net/satcc_armN of init_net: the table of arm N, in the format of satcc_qtable
+static int satcc_arm_open(struct inode *inode, struct file *file)
+{
+	struct satcc_qtable_file *f;
+	Matrix *m;
+
+	f = vzalloc(sizeof(*f) + QTABLE_FILE_MAX);
+	if (!f)
+		return -ENOMEM;
+	f->net = &init_net;
+	f->arm = (long)PDE_DATA(inode);
+
+	if (!(file->f_mode & FMODE_WRITE))
+	{
+		mutex_lock(&satcc_table_mutex);
+		m = rcu_dereference_protected(arm_tables[f->arm], lockdep_is_held(&satcc_table_mutex));
+		if (m)
+		{
+			fill_meta((struct qtable_meta *)f->buf, &satcc_defaults);
+			memcpy(f->buf + sizeof(struct qtable_meta), m, sizeof(Matrix));
+			f->len = sizeof(struct qtable_meta) + sizeof(Matrix);
+		}
+		mutex_unlock(&satcc_table_mutex);
+	}
+
+	file->private_data = f;
+	return 0;
+}
+
+static const struct file_operations satcc_arm_fops = {
+	.owner = THIS_MODULE,
+	.open = satcc_arm_open,
+	.read = satcc_qtable_read,
+	.write = satcc_qtable_write,
+	.llseek = default_llseek,
+	.flush = satcc_qtable_flush,
+	.release = satcc_qtable_release,
+};
+
+// /proc/net/satcc_ab of init_net: per-arm sums, one line per arm; writing clears them
+static int satcc_ab_show(struct seq_file *m, void *v)
+{
+	int arm, i;
+
+	seq_puts(m, "arm weight loaded");
+	for (i = 0; i < AB_MAX; i++)
+		seq_printf(m, " %s", ab_stat_names[i]);
+	seq_putc(m, '\n');
+	for (arm = 0; arm < SATCC_ARMS; arm++)
+	{
+		seq_printf(m, "%d %u %d", arm, READ_ONCE(ab_weight[arm]),
+				   !arm || rcu_access_pointer(arm_tables[arm]));
+		for (i = 0; i < AB_MAX; i++)
+			seq_printf(m, " %lld", (long long)atomic64_read(&ab_stats[arm][i]));
+		seq_putc(m, '\n');
+	}
+	return 0;
+}
+
+static int satcc_ab_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, satcc_ab_show, NULL);
+}
+
+static ssize_t satcc_ab_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+	int arm, i;
+
+	for (arm = 0; arm < SATCC_ARMS; arm++)
+	{
+		for (i = 0; i < AB_MAX; i++)
+			atomic64_set(&ab_stats[arm][i], 0);
+	}
+	return count;
+}
+
+static const struct file_operations satcc_ab_fops = {
+	.owner = THIS_MODULE,
+	.open = satcc_ab_open,
+	.read = seq_read,
+	.write = satcc_ab_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static void satcc_ab_proc_exit(struct net *net)
+{
+	char name[16];
+	int arm;
+
+	remove_proc_entry("satcc_ab", net->proc_net);
+	for (arm = 1; arm < SATCC_ARMS; arm++)
+	{
+		snprintf(name, sizeof(name), "satcc_arm%d", arm);
+		remove_proc_entry(name, net->proc_net);
+	}
+}
+
+static int satcc_ab_proc_init(struct net *net)
+{
+	char name[16];
+	int arm;
+
+	if (!proc_create_data("satcc_ab", 0600, net->proc_net, &satcc_ab_fops, NULL))
+		goto err;
+	for (arm = 1; arm < SATCC_ARMS; arm++)
+	{
+		snprintf(name, sizeof(name), "satcc_arm%d", arm);
+		if (!proc_create_data(name, 0600, net->proc_net, &satcc_arm_fops, (void *)(long)arm))
+			goto err;
+	}
+	return 0;
+
+err:
+	// remove_proc_entry() ignores entries that were not created
+	satcc_ab_proc_exit(net);
+	return -ENOMEM;
+}
+
+static int __net_init satcc_net_init(struct net *net)
+{
+	struct satcc_net *sn = satcc_pernet(net);
+	struct ctl_table *tbl = satcc_sysctl_table;
+	int i;
+
+	rwlock_init(&sn->lock);
+	if (net_eq(net, &init_net))
+	{
+		sn->p = &satcc_defaults;
+		sn->matrix = &matrix;
+		mutex_lock(&satcc_table_mutex);
+		i = satcc_replicas_refresh(sn, &matrix);
+		mutex_unlock(&satcc_table_mutex);
+		if (i)
+			return i;
+	}
+	else
+	{
+		sn->params = satcc_defaults;
+		atomic_set(&sn->params.explorations, 0);
+		sn->p = &sn->params;
+		sn->matrix = NULL;
+
+		tbl = kmemdup(satcc_sysctl_table, sizeof(satcc_sysctl_table), GFP_KERNEL);
+		if (!tbl)
+			return -ENOMEM;
+		for (i = 0; i < ARRAY_SIZE(satcc_sysctl_table) - 1; i++)
+			tbl[i].data += (void *)sn->p - (void *)&satcc_defaults;
+	}
+
+	sn->sysctl = register_net_sysctl(net, "net/satcc", tbl);
+	if (!sn->sysctl)
+		goto err_sysctl;
+
+	if (!proc_create_data("satcc_qtable", 0600, net->proc_net, &satcc_qtable_fops, net))
+		goto err_proc;
+
+	if (net_eq(net, &init_net) && satcc_ab_proc_init(net))
+		goto err_ab;
+
+	return 0;
+
+err_ab:
+	remove_proc_entry("satcc_qtable", net->proc_net);
+err_proc:
+	unregister_net_sysctl_table(sn->sysctl);
+err_sysctl:
+	if (tbl != satcc_sysctl_table)
+		kfree(tbl);
+	if (rcu_access_pointer(sn->replicas))
+		satcc_replicas_free(rcu_dereference_protected(sn->replicas, 1));
+	return -ENOMEM;
+}
+
+static void __net_exit satcc_net_exit(struct net *net)
+{
+	struct satcc_net *sn = satcc_pernet(net);
+	struct ctl_table *tbl = sn->sysctl->ctl_table_arg;
+
+	struct satcc_replicas *r = rcu_dereference_protected(sn->replicas, 1);
+
+	if (net_eq(net, &init_net))
+		satcc_ab_proc_exit(net);
+	remove_proc_entry("satcc_qtable", net->proc_net);
+	unregister_net_sysctl_table(sn->sysctl);
+	if (r)
+		call_rcu(&r->rcu, satcc_replicas_free_rcu);
+	if (!net_eq(net, &init_net))
+	{
+		kfree(tbl);
+		vfree(sn->matrix);
+	}
+}
+
+static struct pernet_operations satcc_net_ops = {
+	.init = satcc_net_init,
+	.exit = satcc_net_exit,
+	.id = &satcc_net_id,
+	.size = sizeof(struct satcc_net),
+};
+
+static int satcc_lat_show(struct seq_file *m, void *v)
+{
+	u64 sum[LAT_BUCKETS];
+	u64 total;
+	int stage, k, cpu;
+
+	for (stage = 0; stage < STAGE_MAX; stage++)
+	{
+		memset(sum, 0, sizeof(sum));
+		total = 0;
+		for_each_possible_cpu(cpu)
+		{
+			for (k = 0; k < LAT_BUCKETS; k++)
+				sum[k] += per_cpu_ptr(&satcc_lat, cpu)->count[stage][k];
+		}
+		for (k = 0; k < LAT_BUCKETS; k++)
+			total += sum[k];
+		seq_printf(m, "%-8s %llu", satcc_stage_names[stage], total);
+		for (k = 0; k < LAT_BUCKETS; k++)
+		{
+			if (sum[k])
+				seq_printf(m, " %d:%llu", k, sum[k]);
+		}
+		seq_putc(m, '\n');
+	}
+	return 0;
+}
+
+static int satcc_lat_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, satcc_lat_show, NULL);
+}
+
+static ssize_t satcc_lat_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(&satcc_lat, cpu), 0, sizeof(struct satcc_lat));
+	return count;
+}
+
+static const struct file_operations satcc_lat_fops = {
+	.owner = THIS_MODULE,
+	.open = satcc_lat_open,
+	.read = seq_read,
+	.write = satcc_lat_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static ssize_t satcc_lat_enable_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
+{
+	char val[2] = { static_key_enabled(&satcc_lat_enabled) ? '1' : '0', '\n' };
+
+	return simple_read_from_buffer(buf, count, ppos, val, sizeof(val));
+}
+
+static ssize_t satcc_lat_enable_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+	bool enable;
+	int err;
+
+	err = kstrtobool_from_user(buf, count, &enable);
+	if (err)
+		return err;
+	if (enable)
+		static_branch_enable(&satcc_lat_enabled);
+	else
+		static_branch_disable(&satcc_lat_enabled);
+	return count;
+}
+
+static const struct file_operations satcc_lat_enable_fops = {
+	.owner = THIS_MODULE,
+	.read = satcc_lat_enable_read,
+	.write = satcc_lat_enable_write,
+	.llseek = default_llseek,
+};
+
+static int satcc_shadow_show(struct seq_file *m, void *v)
+{
+	static const char * const names[numOfAction + 1] = {"up", "down", "nothing", "tie"};
+	struct satcc_shadow sum, *sh;
+	int cpu, a, b;
+
+	memset(&sum, 0, sizeof(sum));
+	for_each_possible_cpu(cpu)
+	{
+		sh = per_cpu_ptr(&satcc_shadow, cpu);
+		for (a = 0; a < numOfAction; a++)
+			for (b = 0; b <= numOfAction; b++)
+				sum.pairs[a][b] += sh->pairs[a][b];
+		for (a = 0; a < SHADOW_RATE_REGIONS; a++)
+			for (b = 0; b < SHADOW_DELAY_REGIONS; b++)
+			{
+				sum.decisions[a][b] += sh->decisions[a][b];
+				sum.disagree[a][b] += sh->disagree[a][b];
+			}
+		sum.q_margin += sh->q_margin;
+	}
+
+	seq_printf(m, "arm %u q_margin %lld\n", shadow_arm, (long long)sum.q_margin);
+	seq_puts(m, "taken\\shadow");
+	for (b = 0; b <= numOfAction; b++)
+		seq_printf(m, " %s", names[b]);
+	seq_putc(m, '\n');
+	for (a = 0; a < numOfAction; a++)
+	{
+		seq_printf(m, "%s", names[a]);
+		for (b = 0; b <= numOfAction; b++)
+			seq_printf(m, " %llu", sum.pairs[a][b]);
+		seq_putc(m, '\n');
+	}
+	// disagreements/decisions, rows are throughput bands, columns delay bands
+	seq_puts(m, "regions\n");
+	for (a = 0; a < SHADOW_RATE_REGIONS; a++)
+	{
+		for (b = 0; b < SHADOW_DELAY_REGIONS; b++)
+			seq_printf(m, "%s%llu/%llu", b ? " " : "", sum.disagree[a][b], sum.decisions[a][b]);
+		seq_putc(m, '\n');
+	}
+	return 0;
+}
+
+static int satcc_shadow_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, satcc_shadow_show, NULL);
+}
+
+static ssize_t satcc_shadow_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(&satcc_shadow, cpu), 0, sizeof(struct satcc_shadow));
+	return count;
+}
+
+static const struct file_operations satcc_shadow_fops = {
+	.owner = THIS_MODULE,
+	.open = satcc_shadow_open,
+	.read = seq_read,
+	.write = satcc_shadow_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static void satcc_debugfs_init(void)
+{
+	satcc_debugfs = debugfs_create_dir("satcc", NULL);
+	if (IS_ERR_OR_NULL(satcc_debugfs))
+		return;
+	debugfs_create_file("latency", 0600, satcc_debugfs, NULL, &satcc_lat_fops);
+	debugfs_create_file("latency_enable", 0600, satcc_debugfs, NULL, &satcc_lat_enable_fops);
+	debugfs_create_file("shadow", 0600, satcc_debugfs, NULL, &satcc_shadow_fops);
+}
+
+// reported in the tcpvegas_info layout, as tcp_illinois does; the fields are
+// enabled = decisions, rttcnt = fallback decisions, rtt = srtt and minrtt, in us
+static size_t q_cong_get_info(struct sock *sk, u32 ext, int *attr, union tcp_cc_info *info)
+{
+	struct Q_cong *qc = inet_csk_ca(sk);
+
+	if (ext & (1 << (INET_DIAG_VEGASINFO - 1)))
+	{
+		info->vegas.tcpv_enabled = qc->ext ? qc->ext->decisions : 0;
+		info->vegas.tcpv_rttcnt = qc->ext ? qc->ext->fallbacks : 0;	// decisions taken by fallback_action()
+		info->vegas.tcpv_rtt = tcp_sk(sk)->srtt_us >> 3;
+		info->vegas.tcpv_minrtt = qc->min_rtt_us;
+		*attr = INET_DIAG_VEGASINFO;
+		return sizeof(struct tcpvegas_info);
+	}
+	return 0;
+}
+
 struct tcp_congestion_ops q_cong = {
 	.flags = TCP_CONG_NON_RESTRICTED,
 	.init = init_Q_cong,
@@ -666,25 +2875,118 @@ struct tcp_congestion_ops q_cong = {
 	.owner = THIS_MODULE,
 	.ssthresh = q_cong_ssthresh,
 	.cong_control = q_cong_main,
+	.in_ack_event = q_cong_in_ack_event,
+	.cwnd_event = q_cong_cwnd_event,
 	.undo_cwnd = q_cong_undo_cwnd,
+	.set_state = q_cong_set_state,
+	.get_info = q_cong_get_info,
 };
 
+#ifdef CONFIG_MPTCP
+static struct tcp_congestion_ops q_cong_coupled = {
+	.flags = TCP_CONG_NON_RESTRICTED,
+	.init = init_Q_cong,
+	.release = release_Q_cong,
+	.name = "satcc_coupled",
+	.owner = THIS_MODULE,
+	.ssthresh = q_cong_ssthresh,
+	.cong_control = q_cong_main,
+	.in_ack_event = q_cong_in_ack_event,
+	.cwnd_event = q_cong_cwnd_event,
+	.undo_cwnd = q_cong_undo_cwnd,
+	.set_state = q_cong_set_state,
+	.get_info = q_cong_get_info,
+};
+#endif
+
 static int __init Q_cong_init(void)
 {	
 	int i;
-	read_Matrix(&matrix);
+	int ret;
+	u64 seed;
+	struct qtable_meta meta;
+	u16 Q_row[numOfState] = {state0_max, state1_max, state2_max};
+	int has_meta;
+
+	for_each_possible_cpu(i)
+	{
+		get_random_bytes(&seed, sizeof(seed));
+		prandom_seed_state(per_cpu_ptr(&satcc_rnd_state, i), seed);
+	}
+
+	has_meta = read_Matrix(&matrix, &meta);
+	if (!matrix.col)
+		createMatrix(&matrix, Q_row, numOfAction);	// no table yet, start blank
+	else if (!matrix_layout_ok(&matrix))
+	{
+		printk(KERN_ERR "qtable is %ux%ux%ux%u, this build needs %ux%ux%ux%u",
+			   matrix.row[0], matrix.row[1], matrix.row[2], matrix.col,
+			   state0_max, state1_max, state2_max, numOfAction);
+		return -EINVAL;
+	}
+	if (has_meta)
+	{
+		printk(KERN_INFO "qtable reward %u (%u,%u,%u,%u) lr %u discount %u",
+			   meta.reward, meta.alpha, meta.beta, meta.gamma, meta.delay_target_ms,
+			   meta.learning_rate, meta.discount_factor);
+		adopt_meta(&satcc_defaults, &satcc_builtin, &meta);
+		ADOPT_META("learning_rate", learning_rate, LEARNING_RATE_INIT, meta.learning_rate);
+		ADOPT_META("discount_factor", discount_factor, DISCOUNT_FACTOR_INIT, meta.discount_factor);
+	}
 	printk(KERN_INFO "qtable col : %d", matrix.col);
 	for(i=0;i<numOfState;i++){
 		printk(KERN_INFO "qtable row%d : %d", i, matrix.row[i]);
 	}
 	BUILD_BUG_ON(sizeof(struct Q_cong) > ICSK_CA_PRIV_SIZE); 
-	return tcp_register_congestion_control(&q_cong);
+	BUILD_BUG_ON(SATCC_ARMS > 4);	// Q_cong.arm is 2 bits
+
+	if (ecn)
+	{
+		q_cong.flags |= TCP_CONG_NEEDS_ECN;
+#ifdef CONFIG_MPTCP
+		q_cong_coupled.flags |= TCP_CONG_NEEDS_ECN;
+#endif
+	}
+
+	ret = register_pernet_subsys(&satcc_net_ops);
+	if (ret)
+		return ret;
+	satcc_debugfs_init();
+
+	ret = tcp_register_congestion_control(&q_cong);
+	if (ret)
+		goto err_register;
+
+#ifdef CONFIG_MPTCP
+	ret = tcp_register_congestion_control(&q_cong_coupled);
+	if (ret)
+	{
+		tcp_unregister_congestion_control(&q_cong);
+		goto err_register;
+	}
+#endif
+	return 0;
+
+err_register:
+	debugfs_remove_recursive(satcc_debugfs);
+	unregister_pernet_subsys(&satcc_net_ops);
+	return ret;
 }
 
 static void __exit Q_cong_exit(void)
 {
+	int i;
+
 	// save_Matrix(&matrix);
+#ifdef CONFIG_MPTCP
+	tcp_unregister_congestion_control(&q_cong_coupled);
+#endif
 	tcp_unregister_congestion_control(&q_cong);
+	debugfs_remove_recursive(satcc_debugfs);
+	unregister_pernet_subsys(&satcc_net_ops);
+	warm_cache_flush();
+	for (i = 1; i < SATCC_ARMS; i++)
+		vfree(rcu_dereference_protected(arm_tables[i], 1));
 }
 
 module_init(Q_cong_init);
@@ -1,37 +1,215 @@
 #include <linux/module.h>
 #include <net/tcp.h>
+#include <linux/inet_diag.h>
 #include <linux/fs.h>
 #include <linux/uaccess.h>
 #include <linux/slab.h>
 #include <linux/spinlock.h>
+#include <linux/percpu.h>
+#include <linux/workqueue.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/delay.h>
+#include <linux/log2.h>
+#include <linux/vmalloc.h>
+#include <linux/proc_fs.h>
+#include <linux/sysctl.h>
+#include <net/net_namespace.h>
+#include <net/netns/generic.h>
+
+#include "satcc_qtable.h"
 
 DEFINE_RWLOCK(qtable_lock);
 
-#define numOfState 3
-
-#define state0_max 240 	// throughput
-#define state1_max 100  // trans delay
-#define state2_max 1 	// more
-
 #define Q_CONG_SCALE 1024
 
-#define numOfAction 3
-
 #define epsilon 1
 
-#define	sizeOfMatrix 	state0_max * state1_max * state2_max * numOfAction
-
 static const u32 probertt_interval_msec = 10000;
 static const u32 max_probertt_duration_msecs = 200;
 
-static const u32 alpha = 4;
-static const u32 beta = 1;
-static const u32 gamma = 1;
+// per network namespace tunables, also under net.satcc.* sysctls
+struct satcc_params
+{
+	unsigned int reward;
+	unsigned int alpha;
+	unsigned int beta;
+	unsigned int gamma;
+	unsigned int delay_target_ms;
+	unsigned int rate_bins;
+	unsigned int ce_weight;
+};
+
+// the module parameters are init_net's values and the defaults of new namespaces
+static struct satcc_params satcc_defaults = {
+	.reward = REWARD_SATCC,
+	.alpha = 4,
+	.beta = 1,
+	.gamma = 1,
+	.delay_target_ms = 50,
+	.rate_bins = RATE_BINS_LINEAR,
+	.ce_weight = 100,
+};
+
+module_param_named(reward, satcc_defaults.reward, uint, 0644);
+MODULE_PARM_DESC(reward, "Reward kernel: 0 satcc, 1 power, 2 log-utility, 3 delay-target");
+
+module_param_named(alpha, satcc_defaults.alpha, uint, 0644);
+MODULE_PARM_DESC(alpha, "Reward throughput weight");
+
+module_param_named(beta, satcc_defaults.beta, uint, 0644);
+MODULE_PARM_DESC(beta, "Reward delay weight");
+
+module_param_named(gamma, satcc_defaults.gamma, uint, 0644);
+MODULE_PARM_DESC(gamma, "Reward retransmission weight");
+
+module_param_named(delay_target_ms, satcc_defaults.delay_target_ms, uint, 0644);
+MODULE_PARM_DESC(delay_target_ms, "Queueing delay the delay-target reward tolerates without penalty");
+
+module_param_named(rate_bins, satcc_defaults.rate_bins, uint, 0644);
+MODULE_PARM_DESC(rate_bins, "Throughput state axis: 0 linear, 1 logarithmic (1 kbit/s to 1 Tbit/s); tables with metadata set it");
+
+module_param_named(ce_weight, satcc_defaults.ce_weight, uint, 0644);
+MODULE_PARM_DESC(ce_weight, "Reward penalty when every ACK of an interval echoes CE, scaled by the marked fraction");
+
+static unsigned int rtt_grad_step = 64;
+module_param(rtt_grad_step, uint, 0644);
+MODULE_PARM_DESC(rtt_grad_step, "Width of an RTT-gradient state bin, in 1/1024 (64: RTT grows 1 ms per 16 ms)");
+
+static unsigned int recovery_beta = 717;
+module_param(recovery_beta, uint, 0644);
+MODULE_PARM_DESC(recovery_beta, "cwnd after fast recovery (ssthresh), in 1/1024 of the cwnd before the loss");
+
+static unsigned int recovery_skip_updates = 0;
+module_param(recovery_skip_updates, uint, 0644);
+MODULE_PARM_DESC(recovery_skip_updates, "Decision intervals overlapping loss recovery: 0 learn from them (counted in recovery_intervals), 1 skip their Q update");
+
+static unsigned int recovery_intervals = 0;
+module_param(recovery_intervals, uint, 0444);
+MODULE_PARM_DESC(recovery_intervals, "Decision intervals that overlapped loss recovery since load");
+
+static unsigned int cadence = 0;
+module_param(cadence, uint, 0644);
+MODULE_PARM_DESC(cadence, "Decision interval: 0 cadence_rounds x min RTT of wall time, 1 cadence_rounds RTT rounds counted by delivered packets");
+
+static unsigned int cadence_rounds = 2;
+module_param(cadence_rounds, uint, 0644);
+MODULE_PARM_DESC(cadence_rounds, "Nominal decision interval, in min RTTs or RTT rounds");
+
+static unsigned int cadence_adaptive = 0;
+module_param(cadence_adaptive, uint, 0644);
+MODULE_PARM_DESC(cadence_adaptive, "Halve the decision interval (down to 1/2 nominal) when the state jumps, grow it (up to 4x) while it holds");
+
+static unsigned int handover = 0;
+module_param(handover, uint, 0644);
+MODULE_PARM_DESC(handover, "Detect satellite handovers and rebase min RTT, state and bandwidth on them");
+
+static unsigned int handover_rtt_pct = 20;
+module_param(handover_rtt_pct, uint, 0644);
+MODULE_PARM_DESC(handover_rtt_pct, "Step of the per-interval minimum RTT over min RTT, in percent, taken as a handover");
+
+static unsigned int handover_rate_pct = 50;
+module_param(handover_rate_pct, uint, 0644);
+MODULE_PARM_DESC(handover_rate_pct, "Step of the delivery rate, in percent, taken as a handover when the base RTT also moved");
+
+static unsigned int handover_period_ms = 0;
+module_param(handover_period_ms, uint, 0644);
+MODULE_PARM_DESC(handover_period_ms, "Scheduled handovers every period on the wall clock (e.g. 15000), 0 for none");
+
+static unsigned int handover_phase_ms = 0;
+module_param(handover_phase_ms, uint, 0644);
+MODULE_PARM_DESC(handover_phase_ms, "Offset of the scheduled handovers within the period");
+
+static unsigned int handover_probe_ms = 100;
+module_param(handover_probe_ms, uint, 0644);
+MODULE_PARM_DESC(handover_probe_ms, "Bandwidth re-probe after a handover, 0 to disable");
+
+static unsigned int handovers = 0;
+module_param(handovers, uint, 0444);
+MODULE_PARM_DESC(handovers, "Handovers detected or scheduled since load");
+
+static unsigned int fallback = 0;
+module_param(fallback, uint, 0644);
+MODULE_PARM_DESC(fallback, "Decide by a queueing-delay model where all Q-values tie (otherwise random) and when the flow has no table");
+
+static unsigned int fallback_queue_pct = 25;
+module_param(fallback_queue_pct, uint, 0644);
+MODULE_PARM_DESC(fallback_queue_pct, "Queueing delay, in percent of min RTT, above which the fallback policy drains");
+
+static unsigned int ecn = 0;
+module_param(ecn, uint, 0444);
+MODULE_PARM_DESC(ecn, "Negotiate ECN and use the CE-marked fraction in state and reward");
 
 static const char procname[] = "satcc";
 
-static const int learning_rate = 512;
-static const int discount_factor = 12;
+static int learning_rate = 512;
+module_param(learning_rate, int, 0644);
+MODULE_PARM_DESC(learning_rate, "Q learning rate, in 1/1024");
+
+static int discount_factor = 12;
+module_param(discount_factor, int, 0644);
+MODULE_PARM_DESC(discount_factor, "Q discount factor, in 1/16");
+
+enum update_rule
+{
+	RULE_Q,			// one-step Q-learning
+	RULE_Q_LAMBDA,	// Watkins Q(lambda)
+	RULE_DOUBLE_Q,	// Double Q-learning
+};
+
+#define Q_TRACE_LEN 3	// eligibility trace entries kept per flow
+
+static unsigned int update_rule = RULE_Q;
+module_param(update_rule, uint, 0644);
+MODULE_PARM_DESC(update_rule, "Q update rule for new flows: 0 Q-learning, 1 Watkins Q(lambda), 2 Double Q-learning");
+
+static unsigned int lambda = 12;
+module_param(lambda, uint, 0644);
+MODULE_PARM_DESC(lambda, "Q(lambda) trace decay, in 1/16 (default 12)");
+
+static unsigned int lr_decay_visits = 0;
+module_param(lr_decay_visits, uint, 0644);
+MODULE_PARM_DESC(lr_decay_visits, "Decay learning rate as K/(K+visits) per state-action, 0 keeps it fixed");
+
+static unsigned int lr_min = 32;
+module_param(lr_min, uint, 0644);
+MODULE_PARM_DESC(lr_min, "Lower bound of the decayed learning rate, in 1/1024");
+
+static unsigned int replay = 0;
+module_param(replay, uint, 0644);
+MODULE_PARM_DESC(replay, "Queue transitions of new flows to per-CPU rings and learn in a worker on the shared table");
+
+static unsigned int replay_batch = 32;
+module_param(replay_batch, uint, 0644);
+MODULE_PARM_DESC(replay_batch, "Queued transitions on a CPU that kick the replay worker");
+
+static unsigned int replay_ratio = 2;
+module_param(replay_ratio, uint, 0644);
+MODULE_PARM_DESC(replay_ratio, "Past transitions replayed per new transition");
+
+static unsigned int replay_dropped = 0;
+module_param(replay_dropped, uint, 0444);
+MODULE_PARM_DESC(replay_dropped, "Transitions dropped because a per-CPU ring was full");
+
+static unsigned int dyna = 0;
+module_param(dyna, uint, 0444);
+MODULE_PARM_DESC(dyna, "Learn a transition model from replayed transitions and plan on it in a background thread (needs replay)");
+
+static unsigned int dyna_steps = 64;
+module_param(dyna_steps, uint, 0644);
+MODULE_PARM_DESC(dyna_steps, "Planning updates per wakeup of the planning thread");
+
+static unsigned int dyna_interval_ms = 10;
+module_param(dyna_interval_ms, uint, 0644);
+MODULE_PARM_DESC(dyna_interval_ms, "Sleep of the planning thread between batches");
+
+static unsigned int dyna_updates = 0;
+module_param(dyna_updates, uint, 0444);
+MODULE_PARM_DESC(dyna_updates, "Planning updates applied since load");
+
+static unsigned int td_error = 0;
+module_param(td_error, uint, 0444);
+MODULE_PARM_DESC(td_error, "EWMA of |TD error| x16 over all updates, for measuring convergence");
 
 #define MY_SAVE_FILE "/qtable-train-result"
 #define MY_READ_FILE "/qtable-train"
@@ -51,20 +229,104 @@ enum q_cong_mode
 	STARTUP,
 };
 
-typedef struct
+static Matrix matrix;
+static Matrix matrix_b;	// second table for Double Q-learning
+static u16 visits[sizeOfMatrix];
+
+// learning state of a namespace other than init_net
+struct satcc_net_tables
 {
-	u8 enabled;
-	int mat[sizeOfMatrix];
-	u8 row[numOfState];
-	u8 col;
-} Matrix;
+	Matrix matrix;
+	Matrix matrix_b;
+	u16 visits[sizeOfMatrix];
+};
 
-static Matrix matrix;
+struct satcc_net
+{
+	struct satcc_params params;	// own copy, init_net uses satcc_defaults
+	struct satcc_params *p;
+	Matrix *matrix;
+	Matrix *matrix_b;
+	bool double_q;			// matrix_b was last written by a Double Q flow, exports average it
+	u16 *visits;
+	rwlock_t *lock;			// protects the tables, qtable_lock for init_net
+	rwlock_t own_lock;
+	struct satcc_net_tables *tables;
+	struct ctl_table_header *sysctl;
+};
 
-struct Q_cong
+static unsigned int satcc_net_id __read_mostly;
+
+static struct satcc_net *satcc_pernet(const struct net *net)
 {
-	bool forced_update;
+	return net_generic(net, satcc_net_id);
+}
+
+#define REPLAY_RING_SIZE 256	// per CPU, power of 2
+#define REPLAY_MEMORY_SIZE 4096	// power of 2
 
+struct transition
+{
+	u16 prev_state[numOfState];
+	u16 current_state[numOfState];
+	u8 action;
+	int reward;
+};
+
+// single producer (ACK path of this CPU, BH off), single consumer (replay_work)
+struct replay_ring
+{
+	u32 head;
+	u32 tail;
+	struct transition buf[REPLAY_RING_SIZE];
+};
+
+static struct replay_ring __percpu *replay_rings;
+static struct transition replay_memory[REPLAY_MEMORY_SIZE];
+static u32 replay_count = 0;
+
+/*
+ * Dyna-Q model: per observed (state, action), the last next state and an
+ * EWMA of the reward, a deterministic model as in tabular Dyna-Q. Entries
+ * are kept densely so planning can sample observed pairs only; slot maps a
+ * matrix index to its entry + 1. Written by replay_work, read by the
+ * planning thread, both under qtable_lock.
+ */
+#define DYNA_MODEL_SIZE 16384
+
+struct dyna_model
+{
+	u32 slot[sizeOfMatrix];
+	u32 count;
+	struct transition entry[DYNA_MODEL_SIZE];
+};
+
+static struct dyna_model *model;
+static struct task_struct *dyna_thread;
+
+// per-flow state that does not fit in the icsk_ca_priv area
+struct Q_cong_ext
+{
+	u32 trace[Q_TRACE_LEN];	// matrix index of past (state, action), newest first
+	u32 last_srtt_us;	// srtt at the last decision
+	s16 rtt_grad;		// smoothed srtt gradient, in 1/1024
+	u32 interval_min_rtt_us;	// lowest RTT sample since the last decision
+	u32 prev_min_rtt_us;	// same for the interval before
+	u32 handover_slot;	// scheduled handover slot of the last decision
+	u32 decisions;
+	u32 fallbacks;		// decisions taken by fallback_action()
+	u32 interval_ms;	// length of the last decision interval
+	u32 round_delivered;	// tp->delivered at the start of the RTT round
+	u8 rounds;		// RTT rounds since the last decision
+	u8 cadence_scale;	// decision interval in quarters of the nominal one
+	u32 loss_cwnd;		// cwnd before the last loss, for undo
+	u16 ce_frac;		// CE-marked fraction of the last interval, in 1/1024
+	u16 ce_acked;		// packets acked in this interval
+	u16 ce_marked;		// of which acked by ACKs echoing CE
+};
+
+struct Q_cong
+{
 	u32 mode : 3,
 		exited : 1,
 		up_times : 4,
@@ -72,15 +334,20 @@ struct Q_cong
 		up_n : 3,
 		epsilon_step : 6,
 		epsilon_count : 4,
-		unused : 11;
+		rule : 2,
+		trace_len : 2,
+		replay : 1,
+		ece : 1,
+		idle : 1,
+		app_limited : 1,
+		recovery : 1,
+		action : 8;	// -1 (all ones) before the first decision
 	u32 last_sequence;
 	u32 estimated_throughput;
-	u16 last_throughput_mean[5];
 	u32 last_update_stamp;
 	u32 last_packet_loss;
 	u32 retransmit_during_interval;
 
-    u8 throughput_count;
 	u32 smooth_throughput;
 
 	u32 last_probertt_stamp;
@@ -88,12 +355,13 @@ struct Q_cong
 	u32 min_rtt_us;
 	u32 prop_rtt_us;
 	u16 prior_cwnd;
+	u16 last_throughput_mean[5];	// rate_pack()ed
 
 	u16 current_state[numOfState];
 	u16 prev_state[numOfState];
-	u8 action;
 
 	Matrix *qtable;
+	struct Q_cong_ext *ext;	// NULL if the allocation failed, extra features then stay idle
 };
 
 static int matrix_init = 0;
@@ -132,12 +400,23 @@ static void eraseMatrix(Matrix *m)
 	m->enabled = 0;
 }
 
+// lookups stride by the table's own dims, so they must be the build's
+static bool matrix_layout_ok(const Matrix *m)
+{
+	return m->col == numOfAction && m->row[0] == state0_max &&
+		m->row[1] == state1_max && m->row[2] == state2_max;
+}
+
+static u32 getMatIndex(Matrix *m, u16 row1, u16 row2, u16 row3, u16 col){
+	return m->col * (row1 * m->row[1] * m->row[2] + row2 * m->row[2] + row3) + col;
+}
+
 static void setMatValue(Matrix *m, u16 row1, u16 row2, u16 row3, u16 col, int v){
 	u32 index = 0; 
 	if (!m)
 		return;
 
-	index = m->col * (row1 * m->row[1] * m->row[2] + row2 * m->row[2] + row3) + col;
+	index = getMatIndex(m, row1, row2, row3, col);
 	*(m -> mat + index) = v;
 }
 
@@ -146,63 +425,101 @@ static int getMatValue(Matrix *m, u16 row1, u16 row2, u16 row3, u16 col){
 	if (!m)
 		return -1; 
 
-	index = m->col * (row1 * m->row[1] * m->row[2] + row2 * m->row[2] + row3) + col;
+	index = getMatIndex(m, row1, row2, row3, col);
 	
 	return *(m -> mat + index);
 }
 
+static void fill_meta(struct qtable_meta *meta, struct satcc_params *p)
+{
+	memset(meta, 0, sizeof(*meta));
+	meta->magic = QTABLE_MAGIC;
+	meta->version = QTABLE_VERSION;
+	meta->size = sizeof(*meta);
+	meta->flags = QTABLE_VISITS;
+	meta->reward = p->reward;
+	meta->alpha = p->alpha;
+	meta->beta = p->beta;
+	meta->gamma = p->gamma;
+	meta->delay_target_ms = p->delay_target_ms;
+	meta->ce_weight = p->ce_weight;
+	if (p->rate_bins == RATE_BINS_LOG)
+		meta->flags |= QTABLE_LOG_RATE;
+	meta->learning_rate = learning_rate;
+	meta->discount_factor = discount_factor;
+	meta->update_rule = update_rule;
+}
+
 static void save_Matrix(Matrix *m)
 {
 	struct file *fp;
+	struct qtable_meta meta;
 	loff_t pos;
 	ssize_t res = 0;
 	printk(KERN_INFO "write enter/n");
-	fp = filp_open(MY_SAVE_FILE, O_RDWR | O_CREAT, 0777);
+	fp = filp_open(MY_SAVE_FILE, O_RDWR | O_CREAT | O_TRUNC, 0777);
 	if (IS_ERR(fp))
 	{
 		printk(KERN_INFO "create file error/n");
 		return;
 	}
 
+	fill_meta(&meta, &satcc_defaults);
 	pos = 0;
-	res = kernel_write(fp, m, sizeof(Matrix), &pos);
+	res = kernel_write(fp, &meta, sizeof(meta), &pos);
+	if (res >= 0)
+		res = kernel_write(fp, m, sizeof(Matrix), &pos);
+	if (res >= 0)
+		res = kernel_write(fp, visits, sizeof(visits), &pos);
 	if (res < 0)
-	{
 		printk(KERN_INFO "kernel_write error: %ld\n", res);
-		return;
-	}
 
 	filp_close(fp, NULL);
 }
 
-static void read_Matrix(Matrix *m)
+/*
+ * Loads a table written by save_Matrix() or a bare Matrix dump of older
+ * releases. Returns 1 and fills *meta when the file carries metadata.
+ */
+static int read_Matrix(Matrix *m, struct qtable_meta *meta)
 {
 	struct file *fp;
 	loff_t pos;
 	ssize_t res = 0;
+	int has_meta = 0;
 	printk(KERN_INFO "reader enter/n");
 	fp = filp_open(MY_READ_FILE, O_RDWR | O_CREAT, 0777);
 	if (IS_ERR(fp))
 	{
 		printk(KERN_INFO "create file error/n");
-		return;
+		return 0;
 	}
 
 	pos = 0;
+	res = kernel_read(fp, meta, sizeof(*meta), &pos);
+	if (res == sizeof(*meta) && meta->magic == QTABLE_MAGIC && meta->size >= offsetof(struct qtable_meta, reserved))
+	{
+		has_meta = 1;
+		pos = meta->size;
+		if (meta->size < sizeof(*meta))
+			memset((char *)meta + meta->size, 0, sizeof(*meta) - meta->size);
+	}
+	else
+		pos = 0;
+
 	res = kernel_read(fp, m, sizeof(Matrix), &pos);
 	if (res < 0)
 	{
 		printk("kernel_read error: %ld\n", res);
-		return;
+		filp_close(fp, NULL);
+		return 0;
 	}
+	if (has_meta && (meta->flags & QTABLE_VISITS))
+		kernel_read(fp, visits, sizeof(visits), &pos);
 	printk("read: %p/n", &m);
 
 	filp_close(fp, NULL);
-}
-
-static u32 q_cong_ssthresh(struct sock *sk)
-{
-	return TCP_INFINITE_SSTHRESH;
+	return has_meta;
 }
 
 static u32 epsilon_expore(struct sock *sk, u32 max_index)
@@ -219,17 +536,43 @@ static u32 epsilon_expore(struct sock *sk, u32 max_index)
 	return rand2 % numOfAction;
 }
 
+// rate history entries are u16 floats of kbit/s: 11-bit mantissa, 5-bit exponent
+static u16 rate_pack(u32 kbps)
+{
+	u16 exp = 0;
+
+	while (kbps >= 2048)
+	{
+		kbps >>= 1;
+		exp++;
+	}
+	return exp << 11 | kbps;
+}
+
+static u32 rate_unpack(u16 v)
+{
+	return (u32)(v & 0x7ff) << (v >> 11);
+}
+
+static u32 rate_history_mean(struct Q_cong *qc)
+{
+	u64 sum = 0;
+	u8 i;
+
+	for (i = 0; i < 5; i++)
+		sum += rate_unpack(qc->last_throughput_mean[i]);
+	return div_u64(sum, 5);
+}
+
 static void epsilon_update(struct sock *sk, const struct rate_sample *rs){
 	struct Q_cong *qc = inet_csk_ca(sk);
-	u8 i;
-	u32 sum_throughput;
+	u32 mean_throughput;
 	u32 change_th;
 	u32 change_rtt;
 
-	sum_throughput = 0;
-	for (i = 0; i < 5; i++)
-		sum_throughput += qc->last_throughput_mean[i];
-	change_th = ((int)(sum_throughput/5 - (qc->smooth_throughput>>5)) >= 0) ? (int)(sum_throughput/5 - (qc->smooth_throughput>>5)) : (int)((qc->smooth_throughput>>5) - sum_throughput/5);
+	mean_throughput = rate_history_mean(qc);
+	change_th = mean_throughput > qc->smooth_throughput ? mean_throughput - qc->smooth_throughput :
+			qc->smooth_throughput - mean_throughput;
 	
 	change_rtt = ((rs->rtt_us - qc->min_rtt_us)>>10) >= 0 ? (rs->rtt_us - qc->min_rtt_us)>>10 : (qc->min_rtt_us - rs->rtt_us)>>10;
 	
@@ -243,31 +586,56 @@ static void epsilon_update(struct sock *sk, const struct rate_sample *rs){
 		qc->epsilon_count = 0;
 	}
 
-	if((change_th > (qc->smooth_throughput>>8)) || (change_rtt > (qc->min_rtt_us>>13))){
+	if((change_th > (qc->smooth_throughput>>3)) || (change_rtt > (qc->min_rtt_us>>13))){
 		qc->epsilon_step = 0;
 	}
 }
 
-int softsigntt(int value, int throughput)
+int softsigntt(u32 value, u32 throughput)
 {
 	if(value == 0) value=1;
-    return value * 100 / (value + throughput);
+    return div64_u64((u64)value * 100, (u64)value + throughput);
+}
+
+/*
+ * Deterministic policy for states the table has no opinion on: drain a
+ * standing queue above fallback_queue_pct of min RTT, grow while the queue
+ * stays under a quarter of that, hold in between.
+ */
+static u32 fallback_action(struct sock *sk)
+{
+	struct tcp_sock *tp = tcp_sk(sk);
+	struct Q_cong *qc = inet_csk_ca(sk);
+	u32 srtt_us = tp->srtt_us >> 3;
+	u32 queue_us = srtt_us > qc->min_rtt_us ? srtt_us - qc->min_rtt_us : 0;
+	u32 high_us = qc->min_rtt_us / 100 * fallback_queue_pct;
+
+	if (qc->ext)
+		qc->ext->fallbacks++;
+	if (queue_us > high_us)
+		return CWND_DOWN;
+	if (queue_us <= high_us / 4)
+		return CWND_UP;
+	return CWND_NOTHING;
 }
 
 static u32 getAction(struct sock *sk, const struct rate_sample *rs)
 {
 	struct Q_cong *qc = inet_csk_ca(sk);
 
-	u32 Q[numOfAction];
+	int Q[numOfAction];
 	u8 i;
 	u8 is_equal = 1;
 	u32 max_index = 0;
-	u32 max_tmp = 0;
+	int max_tmp = 0;
 	u32 rand;
+	u32 action;
 
 	for (i = 0; i < numOfAction; i++)
 	{
 		Q[i] = getMatValue(qc->qtable, qc->current_state[0], qc->current_state[1], qc->current_state[2], i);
+		if (qc->rule == RULE_DOUBLE_Q && qc->qtable)
+			Q[i] += getMatValue(qc->qtable + 1, qc->current_state[0], qc->current_state[1], qc->current_state[2], i);
 	}
 
 	max_tmp = Q[0];
@@ -286,25 +654,51 @@ static u32 getAction(struct sock *sk, const struct rate_sample *rs)
 		}
 	}
 
+	if (qc->ext)
+		qc->ext->decisions++;
+	// without a table no update can happen, an exploratory walk would teach nothing
+	if (!qc->qtable || (is_equal && fallback))
+	{
+		qc->trace_len = 0;
+		return fallback_action(sk);
+	}
 	if (is_equal)
 	{
 		get_random_bytes(&rand, sizeof(rand));
 		max_index = (rand % numOfAction);
 	}
 	// printk(KERN_INFO "choose action: %d, and it's q value is %d", max_index, max_tmp);
-	return epsilon_expore(sk, max_index);
+	action = epsilon_expore(sk, max_index);
+
+	// Watkins Q(lambda): an exploratory action cuts the eligibility trace
+	if (action != max_index)
+		qc->trace_len = 0;
+
+	return action;
+}
+
+// log2(v) in 1/8 steps
+static int log2_8(u32 v)
+{
+	u32 l;
+
+	if (v == 0)
+		return 0;
+	l = ilog2(v);
+	if (l >= 3)
+		return l * 8 + ((v >> (l - 3)) & 7);
+	return l * 8 + ((v << (3 - l)) & 7);
 }
 
 static int getRewardFromEnvironment(struct sock *sk, const struct rate_sample *rs)
 {	
-	struct tcp_sock *tp = tcp_sk(sk);
 	struct Q_cong *qc = inet_csk_ca(sk);
+	struct satcc_params *p = satcc_pernet(sock_net(sk))->p;
 	u32 retransmit_division_factor;
 	int result;
-	u8 i;
-	u32 sum_throughput;
 	u32 goodness;
 	int delay;
+	int queue_ms;
 	int fire;
 
 	retransmit_division_factor = qc->retransmit_during_interval + 1;
@@ -312,16 +706,29 @@ static int getRewardFromEnvironment(struct sock *sk, const struct rate_sample *r
 		return 0;
 	fire = retransmit_division_factor;
 
-	sum_throughput = 0;
-	for(i=0;i<5;i++){
-		sum_throughput += qc->last_throughput_mean[i];
-	}
-
-	goodness = softsigntt(qc->estimated_throughput>>5 , (sum_throughput/5)); // 0-99
+	goodness = softsigntt(qc->estimated_throughput, rate_history_mean(qc)); // 0-99
 
 	delay = (rs->rtt_us - qc->min_rtt_us)>>12;
 	if(delay<=0) delay=1;
-	result = alpha * goodness / (beta * delay + gamma * fire);
+
+	switch (p->reward)
+	{
+	case REWARD_POWER:
+		result = p->alpha * goodness * (qc->min_rtt_us >> 4) / max_t(u32, rs->rtt_us >> 4, 1);
+		break;
+	case REWARD_LOG_UTILITY:
+		result = p->alpha * log2_8(qc->estimated_throughput) - p->gamma * (fire - 1) * 8;
+		break;
+	case REWARD_DELAY_TARGET:
+		queue_ms = (rs->rtt_us - qc->min_rtt_us) / USEC_PER_MSEC;
+		result = p->alpha * goodness - p->beta * max_t(int, queue_ms - (int)p->delay_target_ms, 0);
+		break;
+	default:
+		result = p->alpha * goodness / max_t(u32, p->beta * delay + p->gamma * fire, 1);
+		break;
+	}
+	if (qc->ext)
+		result -= (int)(p->ce_weight * qc->ext->ce_frac >> 10);
 	// printk(KERN_INFO "reward : %d, goodness: %d, fire: %d, delay: %d,min_rtt: %d, throughput>>5: %d", result, goodness, fire, delay, qc->min_rtt_us>>10 , qc->estimated_throughput >> 5);
 	return result;
 }
@@ -337,6 +744,9 @@ static void executeAction(struct sock *sk, const struct rate_sample *rs)
 	switch (qc->action)
 	{
 	case CWND_UP:
+		// the application does not fill the current cwnd, more would not be used
+		if (qc->app_limited)
+			break;
 
 		if(tp->snd_cwnd==0) tp->snd_cwnd=1;
 		a = up_actions_list[qc->up_n] / tp->snd_cwnd;
@@ -387,65 +797,201 @@ static void executeAction(struct sock *sk, const struct rate_sample *rs)
 
 }
 
+/*
+ * Loss recovery. With cong_control the kernel leaves cwnd to us during
+ * recovery, so the agent stands aside: fast recovery runs proportional
+ * rate reduction (RFC 6937) from the cwnd before the loss down to
+ * ssthresh, an RTO recovers with packet conservation plus slow start up
+ * to ssthresh, and no decision is taken until the flow is Open again.
+ * The cwnd before the loss (the pre-ProbeRTT one if it hit during
+ * ProbeRTT) is kept for undo after a spurious loss. It is saved here,
+ * as tcp_enter_loss() collapses cwnd to 1 before the state changes.
+ */
+static u32 q_cong_ssthresh(struct sock *sk)
+{
+	struct tcp_sock *tp = tcp_sk(sk);
+	struct Q_cong *qc = inet_csk_ca(sk);
+
+	if (qc->ext)
+		qc->ext->loss_cwnd = qc->mode == ESTIMATE_MIN_RTT ? max_t(u32, qc->prior_cwnd, tp->snd_cwnd) : tp->snd_cwnd;
+	return max_t(u32, (u64)tp->snd_cwnd * min_t(u32, recovery_beta, 1024) >> 10, 2);
+}
+
+static void q_cong_set_state(struct sock *sk, u8 new_state)
+{
+	struct Q_cong *qc = inet_csk_ca(sk);
+
+	if (new_state >= TCP_CA_Recovery)
+		qc->recovery = 1;
+}
+
+static void recovery_cwnd(struct sock *sk, const struct rate_sample *rs)
+{
+	struct tcp_sock *tp = tcp_sk(sk);
+	int delta;
+	int sndcnt;
+
+	if (inet_csk(sk)->icsk_ca_state == TCP_CA_Loss)
+	{
+		tp->snd_cwnd = max(tp->snd_cwnd, tcp_packets_in_flight(tp) + rs->acked_sacked);
+		if (tp->snd_cwnd < tp->snd_ssthresh)
+			tp->snd_cwnd = min(tp->snd_cwnd + rs->acked_sacked, tp->snd_ssthresh);
+		return;
+	}
+
+	// tcp_init_cwnd_reduction() set prior_cwnd, ssthresh and cleared both PRR counters
+	tp->prr_delivered += rs->acked_sacked;
+	delta = tp->snd_ssthresh - tcp_packets_in_flight(tp);
+	if (delta < 0)
+		sndcnt = DIV_ROUND_UP((u64)tp->prr_delivered * tp->snd_ssthresh, max_t(u32, tp->prior_cwnd, 1)) - tp->prr_out;
+	else
+		sndcnt = min_t(int, delta, max_t(int, tp->prr_delivered - tp->prr_out, rs->acked_sacked) + 1);	// PRR-SSRB
+	sndcnt = max(sndcnt, tp->prr_out ? 0 : 1);
+	tp->snd_cwnd = tcp_packets_in_flight(tp) + max(sndcnt, 0);
+}
+
 static u32 q_cong_undo_cwnd(struct sock *sk)
 {
 	struct tcp_sock *tp = tcp_sk(sk);
+	struct Q_cong *qc = inet_csk_ca(sk);
 
-	return max(tp->snd_cwnd, tp->prior_cwnd);
+	// without ext, tcp_enter_loss() and tcp_init_cwnd_reduction() saved it in prior_cwnd
+	return max(tp->snd_cwnd, qc->ext ? qc->ext->loss_cwnd : tp->prior_cwnd);
+}
+
+/*
+ * Decision cadence. The interval is cadence_rounds min RTTs of wall time
+ * or RTT rounds (a round ends when a packet sent after it began is
+ * delivered), times the flow's cadence_scale in quarters. With
+ * cadence_adaptive the scale halves when the throughput or delay state
+ * moves by more than one bin and grows by a quarter per decision that
+ * keeps it, so transients get fast control and steady state few
+ * decisions. Rates and the retransmission count are normalized to the
+ * nominal interval, which keeps rewards comparable across lengths.
+ */
+#define CADENCE_NOMINAL 4	// scale in quarters of the nominal interval
+#define CADENCE_MIN 2
+#define CADENCE_MAX 16
+
+static u32 base_interval_ms(struct Q_cong *qc)
+{
+	return max_t(u32, cadence_rounds, 1) * (qc->min_rtt_us >> 10);
 }
 
 static void calc_retransmit_during_interval(struct sock *sk)
 {
 	struct tcp_sock *tp = tcp_sk(sk);
 	struct Q_cong *qc = inet_csk_ca(sk);
-	u32 training_interval_msec;
-	training_interval_msec = 2 * (qc->min_rtt_us>>10); //2RTT
+	u32 interval_ms = max_t(u32, jiffies_to_msecs(tcp_jiffies32 - qc->last_update_stamp), 1);
 
-	qc->retransmit_during_interval = (tp->total_retrans - qc->last_packet_loss) * training_interval_msec / jiffies_to_msecs(tcp_jiffies32 - qc->last_update_stamp);
+	// per nominal interval, whatever the cadence made this one
+	if (qc->ext)
+		qc->ext->interval_ms = interval_ms;
+	qc->retransmit_during_interval = (tp->total_retrans - qc->last_packet_loss) * base_interval_ms(qc) / interval_ms;
 	qc->last_packet_loss = tp->total_retrans;
 }
 
+// CE-marked fraction since the last decision, 0 without ECN
+static void calc_ce_fraction(struct sock *sk)
+{
+	struct Q_cong *qc = inet_csk_ca(sk);
+	struct Q_cong_ext *ext = qc->ext;
+
+	if (!ext)
+		return;
+	ext->ce_frac = ext->ce_acked ? ((u32)ext->ce_marked << 10) / ext->ce_acked : 0;
+	ext->ce_acked = 0;
+	ext->ce_marked = 0;
+}
+
 static void calc_throughput(struct sock *sk)
 {
 	struct tcp_sock *tp = tcp_sk(sk);
 	struct Q_cong *qc = inet_csk_ca(sk);
 	u8 i;
-	u32 segout_for_interval;
+	u64 segout_for_interval;
+	u32 interval_ms;
+
+	segout_for_interval = (u64)(tp->segs_out - qc->last_sequence) * tp->mss_cache;
+	interval_ms = max_t(u32, jiffies_to_msecs(tcp_jiffies32 - qc->last_update_stamp), 1);
 
-	segout_for_interval = (tp->segs_out - qc->last_sequence) * tp->mss_cache;
+	// kbit/s, u32 holds up to 4 Tbit/s
+	qc->estimated_throughput = min_t(u64, div_u64(segout_for_interval * 8, interval_ms), U32_MAX);
+	qc->last_sequence = tp->segs_out;
 
-	qc->estimated_throughput = segout_for_interval * 8 / jiffies_to_msecs(tcp_jiffies32 - qc->last_update_stamp);
+	// an app-limited rate says nothing about the path unless it is higher: keep state and filters
+	if (qc->app_limited && qc->estimated_throughput < rate_history_mean(qc))
+	{
+		qc->estimated_throughput = rate_history_mean(qc);
+		return;
+	}
 
 	for (i = 0; i < 4; i++)
 		qc->last_throughput_mean[i] = qc->last_throughput_mean[i+1];
-	if((qc->estimated_throughput>>5)<65535) 	//u16
-		qc->last_throughput_mean[4] = qc->estimated_throughput>>5;
-	else
-		qc->last_throughput_mean[4] = 65534;
+	qc->last_throughput_mean[4] = rate_pack(qc->estimated_throughput);
 
 	// smooth_throughput
 	if(qc->smooth_throughput==0) qc->smooth_throughput=qc->estimated_throughput; //first time
 	qc->smooth_throughput = (qc->smooth_throughput - (qc->smooth_throughput>>3)) + (qc->estimated_throughput>>3);
 
-	qc->last_sequence = tp->segs_out;
+}
+
+// smoothed change of srtt per unit of time since the last decision, in 1/1024
+static void calc_rtt_gradient(struct sock *sk)
+{
+	struct tcp_sock *tp = tcp_sk(sk);
+	struct Q_cong *qc = inet_csk_ca(sk);
+	u32 srtt_us = tp->srtt_us >> 3;
+	u32 interval_us = jiffies_to_usecs(tcp_jiffies32 - qc->last_update_stamp);
+	s64 grad;
+
+	if (!qc->ext)
+		return;
+	if (qc->ext->last_srtt_us && interval_us)
+	{
+		grad = div_s64((s64)(s32)(srtt_us - qc->ext->last_srtt_us) << 10, interval_us);
+		grad = clamp_t(s64, grad, -S16_MAX, S16_MAX);
+		qc->ext->rtt_grad += ((int)grad - qc->ext->rtt_grad) / 4;
+	}
+	qc->ext->last_srtt_us = srtt_us;
+}
 
+// third state axis, see satcc_qtable.h
+static u16 feature_bin(struct Q_cong *qc)
+{
+	int ce = qc->ext ? min_t(u32, qc->ext->ce_frac * SATCC_CE_BINS >> 10, SATCC_CE_BINS - 1) : 0;
+	int grad = SATCC_GRAD_BINS / 2;
+
+	if (qc->ext && rtt_grad_step)
+		grad += qc->ext->rtt_grad / (int)rtt_grad_step;
+	grad = clamp_t(int, grad, 0, SATCC_GRAD_BINS - 1);
+
+	return ce * SATCC_GRAD_BINS + grad;
+}
+
+static u16 throughput_bin(struct satcc_params *p, u32 kbps)
+{
+	if (p->rate_bins == RATE_BINS_LOG)
+		return min_t(u32, log2_8(kbps), state0_max - 1);
+	return min_t(u32, kbps >> 8, state0_max - 1);	// 240 -> 0-60Mbps
 }
 
 static void update_state(struct sock *sk, const struct rate_sample *rs)
 {	
 	// struct tcp_sock *tp = tcp_sk(sk);
 	struct Q_cong *qc = inet_csk_ca(sk);
+	struct satcc_params *p = satcc_pernet(sock_net(sk))->p;
 	u8 i;
 	int delay;
 
 	for (i = 0; i < numOfState; i++)
 		qc->prev_state[i] = qc->current_state[i];
 
-	qc->current_state[0] = qc->estimated_throughput>>8; // 240 -> 0-60Mbps
+	qc->current_state[0] = throughput_bin(p, qc->estimated_throughput);
 
-	qc->current_state[2] = 0;	// third axis
+	qc->current_state[2] = feature_bin(qc);	// third axis
 
-	qc->current_state[1] = (rs->rtt_us - qc->min_rtt_us) >> 12;   // 100 -> 0-400ms
+	qc->current_state[1] = min_t(long, max_t(long, rs->rtt_us - (long)qc->min_rtt_us, 0) >> 12, state1_max - 1);   // 100 -> 0-400ms
 
 	if (qc->current_state[0] < 0)
 		qc->current_state[0] = 0;
@@ -464,60 +1010,464 @@ static void update_state(struct sock *sk, const struct rate_sample *rs)
 
 }
 
-static void update_Qtable(struct sock *sk, const struct rate_sample *rs)
+static int getLearningRate(u16 *visits, u32 index, bool visit)
 {
-	struct Q_cong *qc = inet_csk_ca(sk);
+	int lr;
 
-	int thisQ[numOfAction];
+	// planning updates (visits NULL) are not visits
+	if (!visits)
+		return clamp_t(int, learning_rate, 0, Q_CONG_SCALE);
+	// replayed samples take the entry's step size without counting again
+	if (visit && visits[index] < U16_MAX)
+		visits[index]++;
+
+	lr = clamp_t(int, learning_rate, 0, Q_CONG_SCALE);
+	if (!lr_decay_visits)
+		return lr;
+
+	return max_t(int, lr_min, lr * lr_decay_visits / (lr_decay_visits + visits[index]));
+}
+
+/*
+ * One Q-learning step on qa for (prev_state, action). The bootstrap value
+ * of next_state is read from qb (qb == qa for plain Q-learning).
+ * visit counts it in visits, which set the step size. Returns the TD error,
+ * *index and *lr are set to the updated matrix entry and the learning
+ * rate used for it.
+ */
+static int updateQvalue(Matrix *qa, Matrix *qb, u16 *visits, bool visit, u16 *prev_state, u8 action,
+						u16 *next_state, int reward, u32 *index, int *lr)
+{
+	int thisQ;
 	int newQ[numOfAction];
 	u8 i;
 	int updated_Qvalue;
 	int max_tmp;
+	u32 max_index = 0;
+	int td;
+
+	*index = getMatIndex(qa, prev_state[0], prev_state[1], prev_state[2], action);
+	thisQ = *(qa->mat + *index);
 	for (i = 0; i < numOfAction; i++)
 	{
-		thisQ[i] = getMatValue(qc->qtable, qc->prev_state[0], qc->prev_state[1], qc->prev_state[2], i);
-		newQ[i] = getMatValue(qc->qtable, qc->current_state[0], qc->current_state[1], qc->current_state[2], i);
-		// printk(KERN_INFO "i: %u, this Q %d", i ,thisQ[i]);
+		newQ[i] = getMatValue(qa, next_state[0], next_state[1], next_state[2], i);
+		// printk(KERN_INFO "i: %u, this Q %d", i ,thisQ);
 	}
 
 	max_tmp = newQ[0];
 	for (i = 0; i < numOfAction; i++)
 	{
 		if (max_tmp < newQ[i])
+		{
 			max_tmp = newQ[i];
+			max_index = i;
+		}
 	}
-	updated_Qvalue = ((Q_CONG_SCALE - learning_rate) * thisQ[qc->action] +
-					  (learning_rate * (getRewardFromEnvironment(sk, rs) + ((discount_factor * max_tmp)/16)))) >>
-					 10;
+	if (qb != qa)
+		max_tmp = getMatValue(qb, next_state[0], next_state[1], next_state[2], max_index);
+
+	*lr = getLearningRate(visits, *index, visit);
+	updated_Qvalue = reward + ((clamp_t(int, discount_factor, 0, 16) * max_tmp)/16);
+	td = updated_Qvalue - thisQ;
+	updated_Qvalue = ((Q_CONG_SCALE - *lr) * thisQ + (*lr * updated_Qvalue)) >> 10;
 
-	setMatValue(qc->qtable, qc->prev_state[0], qc->prev_state[1], qc->prev_state[2], qc->action, updated_Qvalue);
+	*(qa->mat + *index) = updated_Qvalue;
+	td_error = td_error - (td_error >> 4) + abs(td);
 	// printk(KERN_INFO "before q is %d, after q is %d", max_tmp, updated_Qvalue);
+
+	return td;
+}
+
+static void update_Qtable(struct sock *sk, const struct rate_sample *rs)
+{
+	struct Q_cong *qc = inet_csk_ca(sk);
+	Matrix *qa = qc->qtable;
+	Matrix *qb = qc->qtable;
+
+	u8 i;
+	u32 index;
+	u32 rand;
+	int lr;
+	int td;
+	int trace_factor;
+
+	if (!qa)
+		return;
+
+	// Double Q: pick the table to update at random, evaluate with the other one
+	if (qc->rule == RULE_DOUBLE_Q)
+	{
+		get_random_bytes(&rand, sizeof(rand));
+		if (rand & 1)
+			qa = qc->qtable + 1;
+		else
+			qb = qc->qtable + 1;
+	}
+
+	td = updateQvalue(qa, qb, satcc_pernet(sock_net(sk))->visits, true, qc->prev_state, qc->action, qc->current_state,
+					  getRewardFromEnvironment(sk, rs), &index, &lr);
+
+	if (qc->rule != RULE_Q_LAMBDA || !qc->ext)
+		return;
+
+	// Q(lambda): older pairs on the trace get the same TD error, discounted by (gamma*lambda)^k
+	trace_factor = Q_CONG_SCALE;
+	for (i = 0; i < qc->trace_len; i++)
+	{
+		trace_factor = trace_factor * clamp_t(int, discount_factor, 0, 16) * min_t(u32, lambda, 16) / 256;
+		*(qa->mat + qc->ext->trace[i]) += ((s64)td * lr * trace_factor) >> 20;
+	}
+
+	for (i = Q_TRACE_LEN - 1; i > 0; i--)
+		qc->ext->trace[i] = qc->ext->trace[i - 1];
+	qc->ext->trace[0] = index;
+	if (qc->trace_len < Q_TRACE_LEN)
+		qc->trace_len++;
+}
+
+static void replay_work_fn(struct work_struct *work);
+static DECLARE_WORK(replay_work, replay_work_fn);
+
+static void applyTransition(struct transition *t, bool visit)
+{
+	u32 index;
+	int lr;
+
+	updateQvalue(&matrix, &matrix, visits, visit, t->prev_state, t->action, t->current_state, t->reward, &index, &lr);
+}
+
+static void dyna_record(struct transition *t)
+{
+	struct transition *e;
+	u32 index;
+
+	index = getMatIndex(&matrix, t->prev_state[0], t->prev_state[1], t->prev_state[2], t->action);
+	if (model->slot[index])
+	{
+		e = &model->entry[model->slot[index] - 1];
+		memcpy(e->current_state, t->current_state, sizeof(e->current_state));
+		e->reward += (t->reward - e->reward) / 4;
+		return;
+	}
+	if (model->count >= DYNA_MODEL_SIZE)
+		return;
+	model->entry[model->count] = *t;
+	model->slot[index] = ++model->count;
+}
+
+// simulated transitions from the model, at the lowest priority
+static int dyna_fn(void *data)
+{
+	u32 index;
+	u32 i;
+	int lr;
+	struct transition *e;
+
+	set_user_nice(current, MAX_NICE);
+	while (!kthread_should_stop())
+	{
+		write_lock_bh(&qtable_lock);
+		for (i = 0; i < dyna_steps && model->count > 0; i++)
+		{
+			e = &model->entry[prandom_u32() % model->count];
+			updateQvalue(&matrix, &matrix, NULL, false, e->prev_state, e->action, e->current_state, e->reward, &index, &lr);
+			dyna_updates++;
+		}
+		write_unlock_bh(&qtable_lock);
+		msleep_interruptible(max_t(u32, dyna_interval_ms, 1));
+	}
+	return 0;
+}
+
+#define REPLAY_BUDGET 64	// table updates per qtable_lock hold, fresh and replayed
+
+/*
+ * Drains the CPU rings into the shared table, replaying past transitions
+ * along the way. The lock is held for one bounded batch of one ring at a
+ * time so ACK-path readers and BH are not held off for a whole drain;
+ * what is left reschedules the work. Called with NULL on unload, it
+ * drains everything.
+ */
+static void replay_work_fn(struct work_struct *work)
+{
+	struct replay_ring *ring;
+	struct transition *t;
+	u32 ratio = min_t(u32, READ_ONCE(replay_ratio), REPLAY_BUDGET - 1);
+	u32 batch = max_t(u32, REPLAY_BUDGET / (ratio + 1), 1);
+	u32 head;
+	u32 tail;
+	u32 i;
+	bool more;
+	int cpu;
+
+	do
+	{
+		more = false;
+		for_each_possible_cpu(cpu)
+		{
+			ring = per_cpu_ptr(replay_rings, cpu);
+			tail = ring->tail;
+			head = smp_load_acquire(&ring->head);
+			if (tail == head)
+				continue;
+			if (head - tail > batch)
+			{
+				head = tail + batch;
+				more = true;
+			}
+
+			write_lock_bh(&qtable_lock);
+			for (; tail != head; tail++)
+			{
+				t = &ring->buf[tail & (REPLAY_RING_SIZE - 1)];
+				applyTransition(t, true);
+				if (model)
+					dyna_record(t);
+
+				for (i = 0; i < ratio && replay_count > 0; i++)
+					applyTransition(&replay_memory[prandom_u32() % min_t(u32, replay_count, REPLAY_MEMORY_SIZE)], false);
+				replay_memory[replay_count & (REPLAY_MEMORY_SIZE - 1)] = *t;
+				replay_count++;
+			}
+			satcc_pernet(&init_net)->double_q = false;	// replay learns on matrix alone
+			write_unlock_bh(&qtable_lock);
+			smp_store_release(&ring->tail, tail);
+			cond_resched();
+		}
+	} while (more && !work);
+
+	if (more)
+		schedule_work(&replay_work);
+}
+
+// ACK path side of replay mode: only a ring enqueue, learning happens in replay_work
+static void push_transition(struct sock *sk, const struct rate_sample *rs)
+{
+	struct Q_cong *qc = inet_csk_ca(sk);
+	struct replay_ring *ring;
+	struct transition *t;
+	u32 head;
+	u32 pending;
+	u8 i;
+
+	local_bh_disable();
+	ring = this_cpu_ptr(replay_rings);
+	head = ring->head;
+	pending = head - smp_load_acquire(&ring->tail);
+	if (pending >= REPLAY_RING_SIZE)
+	{
+		replay_dropped++;
+		local_bh_enable();
+		schedule_work(&replay_work);
+		return;
+	}
+
+	t = &ring->buf[head & (REPLAY_RING_SIZE - 1)];
+	for (i = 0; i < numOfState; i++)
+	{
+		t->prev_state[i] = qc->prev_state[i];
+		t->current_state[i] = qc->current_state[i];
+	}
+	t->action = qc->action;
+	t->reward = getRewardFromEnvironment(sk, rs);
+	smp_store_release(&ring->head, head + 1);
+	local_bh_enable();
+
+	if (pending + 1 >= replay_batch)
+		schedule_work(&replay_work);
+}
+
+// number of the scheduled handover slot the wall clock is in
+static u32 handover_slot(u32 period_ms)
+{
+	u64 now_ms = div_u64(ktime_get_real_ns(), NSEC_PER_MSEC);
+
+	return div_u64(now_ms - handover_phase_ms, period_ms);
+}
+
+// an abrupt step of the base RTT, or a rate step with a smaller RTT move, in the last interval
+static bool handover_detected(struct sock *sk)
+{
+	struct Q_cong *qc = inet_csk_ca(sk);
+	u32 base = qc->min_rtt_us;
+	u32 step = base / 100 * handover_rtt_pct;
+	u32 cur = qc->ext->interval_min_rtt_us;
+	u32 prev = qc->ext->prev_min_rtt_us;
+	u32 rate_step = qc->smooth_throughput / 100 * handover_rate_pct;
+	bool rate_moved;
+
+	if (cur == U32_MAX || !base)
+		return false;
+	if (cur > base + step && prev <= base + step)
+		return true;
+
+	rate_moved = qc->estimated_throughput > qc->smooth_throughput + rate_step ||
+				 qc->estimated_throughput + rate_step < qc->smooth_throughput;
+	return rate_moved && (cur > base + step / 2 || cur + step / 2 < base);
+}
+
+/*
+ * Checks for a handover at a decision. On one, min RTT is rebased to the
+ * new path, the throughput history restarts from the current estimate so
+ * state and epsilon_update() see the new link, and a short STARTUP phase
+ * re-probes the bandwidth.
+ */
+static bool handover_check(struct sock *sk, const struct rate_sample *rs)
+{
+	struct Q_cong *qc = inet_csk_ca(sk);
+	struct Q_cong_ext *ext = qc->ext;
+	bool hit = false;
+	u32 period_ms = READ_ONCE(handover_period_ms);	// may be set to 0 under us
+	u32 slot;
+	u8 i;
+
+	if (!handover || !ext)
+		return false;
+
+	if (period_ms)
+	{
+		slot = handover_slot(period_ms);
+		hit = ext->handover_slot && slot != ext->handover_slot;
+		ext->handover_slot = slot;
+	}
+	if (!hit)
+		hit = handover_detected(sk);
+
+	ext->prev_min_rtt_us = ext->interval_min_rtt_us;
+	ext->interval_min_rtt_us = U32_MAX;
+	if (!hit)
+		return false;
+
+	handovers++;
+	if (ext->prev_min_rtt_us != U32_MAX)
+		qc->min_rtt_us = ext->prev_min_rtt_us;
+	if (rs->rtt_us > 0 && rs->rtt_us < qc->min_rtt_us)
+		qc->min_rtt_us = rs->rtt_us;
+	qc->last_probertt_stamp = tcp_jiffies32;
+
+	qc->smooth_throughput = qc->estimated_throughput;
+	for (i = 0; i < 5; i++)
+		qc->last_throughput_mean[i] = rate_pack(qc->estimated_throughput);
+	qc->epsilon_step = 0;
+	qc->epsilon_count = 0;
+	ext->rtt_grad = 0;
+	ext->last_srtt_us = 0;
+
+	if (handover_probe_ms && handover_probe_ms < 2000)
+	{
+		qc->mode = STARTUP;
+		qc->start_up_stamp = tcp_jiffies32 - msecs_to_jiffies(2000 - handover_probe_ms);
+	}
+	return true;
+}
+
+static bool decision_due(struct sock *sk, const struct rate_sample *rs)
+{
+	struct tcp_sock *tp = tcp_sk(sk);
+	struct Q_cong *qc = inet_csk_ca(sk);
+	u32 scale = qc->ext ? qc->ext->cadence_scale : CADENCE_NOMINAL;
+
+	if (cadence && qc->ext)
+	{
+		if (!before(rs->prior_delivered, qc->ext->round_delivered))
+		{
+			qc->ext->round_delivered = tp->delivered;
+			if (qc->ext->rounds < U8_MAX)
+				qc->ext->rounds++;
+		}
+		return qc->ext->rounds * CADENCE_NOMINAL >= max_t(u32, cadence_rounds, 1) * scale;
+	}
+	return after(tcp_jiffies32, qc->last_update_stamp + msecs_to_jiffies(base_interval_ms(qc) * scale / CADENCE_NOMINAL));
+}
+
+// called once current_state holds the new state
+static void cadence_adapt(struct Q_cong *qc)
+{
+	u32 scale;
+
+	if (!qc->ext)
+		return;
+	scale = qc->ext->cadence_scale;
+	if (!cadence_adaptive)
+		scale = CADENCE_NOMINAL;
+	else if (abs(qc->current_state[0] - qc->prev_state[0]) > 1 || abs(qc->current_state[1] - qc->prev_state[1]) > 1)
+		scale = max_t(u32, scale / 2, CADENCE_MIN);
+	else
+		scale = min_t(u32, scale + 1, CADENCE_MAX);
+	qc->ext->cadence_scale = scale;
 }
 
 static void training(struct sock *sk, const struct rate_sample *rs)
 {
 	struct Q_cong *qc = inet_csk_ca(sk);
-	u32 training_interval_msec;
 	u32 training_timer_expired;
-	training_interval_msec = 2 * (qc->min_rtt_us>>10); //2RTT
+	bool moved;
 
-	training_timer_expired = after(tcp_jiffies32, qc->last_update_stamp + msecs_to_jiffies(training_interval_msec));
+	training_timer_expired = decision_due(sk, rs);
+
+	// recovery_cwnd() owns cwnd until the flow is Open again
+	if (inet_csk(sk)->icsk_ca_state >= TCP_CA_Recovery)
+		return;
 
 	if (training_timer_expired && qc->mode == NOTHING)
 	{
-		if (qc->action == 0xffffffff)
+		// no action taken yet (action is a u8, -1 reads back as 255)
+		if (qc->action >= numOfAction)
 			goto execute;
 
 		calc_throughput(sk);
+		calc_ce_fraction(sk);
+		calc_rtt_gradient(sk);
+		moved = handover_check(sk, rs);
 		update_state(sk, rs);
+		cadence_adapt(qc);
 		calc_retransmit_during_interval(sk);
 
-		update_Qtable(sk, rs);
+		// the interval spanning a handover says nothing about the action taken
+		if (moved)
+		{
+			if (qc->mode == STARTUP)
+			{
+				// decisions resume once the re-probe ends
+				qc->action = -1;
+				qc->last_update_stamp = tcp_jiffies32;
+				return;
+			}
+			goto execute;
+		}
+
+		// the decision before an idle gap was not measured
+		if (qc->idle)
+		{
+			qc->idle = 0;
+			goto execute;
+		}
+
+		// an under-driven interval does not show what the action did
+		if (qc->app_limited)
+			goto execute;
+
+		// cwnd followed PRR rather than the action for part of the interval
+		if (qc->recovery)
+		{
+			recovery_intervals++;
+			if (recovery_skip_updates)
+				goto execute;
+		}
+
+		if (qc->replay)
+			push_transition(sk, rs);
+		else
+			update_Qtable(sk, rs);
 	execute:
 		// printk(KERN_INFO "execute Action: %u", qc -> action);
 		qc->action = getAction(sk, rs);
 		executeAction(sk, rs);
 		qc->last_update_stamp = tcp_jiffies32;
+		qc->app_limited = 0;
+		qc->recovery = 0;
+		if (qc->ext)
+			qc->ext->rounds = 0;
 		
 		epsilon_update(sk, rs);
 	}
@@ -534,6 +1484,8 @@ static void update_min_rtt(struct sock *sk, const struct rate_sample *rs)
 
 	if (rs->rtt_us > 0)
 	{
+		if (qc->ext && rs->rtt_us < qc->ext->interval_min_rtt_us)
+			qc->ext->interval_min_rtt_us = rs->rtt_us;
 		if (rs->rtt_us < qc->min_rtt_us)
 		{
 			qc->min_rtt_us = rs->rtt_us;
@@ -545,6 +1497,10 @@ static void update_min_rtt(struct sock *sk, const struct rate_sample *rs)
 		}
 	}
 
+	// ProbeRTT neither starts nor ends while recovery_cwnd() owns cwnd
+	if (inet_csk(sk)->icsk_ca_state >= TCP_CA_Recovery)
+		return;
+
 	if (update_filter_expired && qc->mode == NOTHING)
 	{
 		qc->mode = ESTIMATE_MIN_RTT;
@@ -577,7 +1533,7 @@ static void reset_cwnd(struct sock *sk, const struct rate_sample *rs){
 		if(inet_csk(sk) -> icsk_ca_state >= TCP_CA_Recovery){
 			qc -> mode = NOTHING; 
 		}
-		else{
+		else if (tcp_is_cwnd_limited(sk)){
 			tp -> snd_cwnd += rs -> acked_sacked;
 		}
 	}
@@ -587,16 +1543,93 @@ static void reset_cwnd(struct sock *sk, const struct rate_sample *rs){
 	}
 }
 
+/*
+ * Sending resumes with nothing in flight. After an application idle
+ * period longer than a decision interval the measurement window would
+ * span the gap and read as a near-zero rate, so rebase it on the restart
+ * and skip the Q update of the decision taken before the gap. The cwnd is
+ * kept (cong_control flows are exempt from slow start after idle), and an
+ * idle pipe has drained its queue, so the gap also counts as an RTT probe.
+ */
+static void q_cong_cwnd_event(struct sock *sk, enum tcp_ca_event event)
+{
+	struct tcp_sock *tp = tcp_sk(sk);
+	struct Q_cong *qc = inet_csk_ca(sk);
+	u32 now = tcp_jiffies32;
+	u32 idle_ms;
+
+	if (event != CA_EVENT_TX_START || qc->mode != NOTHING)
+		return;
+
+	// lsndtime is still the last send before the gap
+	idle_ms = jiffies_to_msecs(now - tp->lsndtime);
+	if (idle_ms <= max_t(u32, base_interval_ms(qc), 1))
+		return;
+
+	qc->idle = 1;
+	qc->last_update_stamp = now;
+	qc->last_sequence = tp->segs_out;
+	qc->last_packet_loss = tp->total_retrans;
+	if (qc->ext)
+	{
+		qc->ext->ce_acked = 0;
+		qc->ext->ce_marked = 0;
+		qc->ext->last_srtt_us = 0;
+		qc->ext->interval_min_rtt_us = U32_MAX;
+	}
+	if (idle_ms >= max_probertt_duration_msecs)
+		qc->last_probertt_stamp = now;
+}
+
+// tcp_ack() reports the ACK's flags before calling cong_control
+static void q_cong_in_ack_event(struct sock *sk, u32 flags)
+{
+	struct Q_cong *qc = inet_csk_ca(sk);
+
+	qc->ece = !!(flags & CA_ACK_ECE);
+}
+
+static void count_ce(struct sock *sk, const struct rate_sample *rs)
+{
+	struct Q_cong *qc = inet_csk_ca(sk);
+	struct Q_cong_ext *ext = qc->ext;
+	u32 acked = rs->acked_sacked;
+
+	if (ext)
+	{
+		// saturate both counters together to keep the fraction
+		if (ext->ce_acked + acked > 0xffff)
+		{
+			ext->ce_acked >>= 1;
+			ext->ce_marked >>= 1;
+			acked = min_t(u32, acked, 0x7fff);
+		}
+		ext->ce_acked += acked;
+		if (qc->ece)
+			ext->ce_marked += acked;
+	}
+	qc->ece = 0;
+}
+
 static void q_cong_main(struct sock *sk, const struct rate_sample *rs)
 {
+	struct Q_cong *qc = inet_csk_ca(sk);
+	if (ecn)
+		count_ce(sk, rs);
+	// an interval is app-limited once a sample is and cwnd was not filled
+	if (rs->is_app_limited && !tcp_is_cwnd_limited(sk))
+		qc->app_limited = 1;
 	reset_cwnd(sk, rs);
 	training(sk, rs);
+	if (inet_csk(sk)->icsk_ca_state >= TCP_CA_Recovery)
+		recovery_cwnd(sk, rs);
 	update_min_rtt(sk, rs);
 }
 
 static void init_Q_cong(struct sock *sk)
 {
 	struct Q_cong *qc;
+	struct satcc_net *sn = satcc_pernet(sock_net(sk));
 	struct tcp_sock *tp = tcp_sk(sk);
 	u16 Q_row[numOfState] = {state0_max, state1_max, state2_max};
 	u16 Q_col = numOfAction;
@@ -609,6 +1642,10 @@ static void init_Q_cong(struct sock *sk)
 	qc->up_n = 0;
 	qc->epsilon_step = 0;
 	qc->epsilon_count = 0;
+	qc->ece = 0;
+	qc->idle = 0;
+	qc->app_limited = 0;
+	qc->recovery = 0;
 	qc->last_sequence = 0;
 	qc->estimated_throughput = 0;
 
@@ -622,7 +1659,6 @@ static void init_Q_cong(struct sock *sk)
 	qc->last_packet_loss = 0;
 	qc->start_up_stamp = tcp_jiffies32;
 
-    qc -> throughput_count = 0;
 	qc -> smooth_throughput = 0;
 
 	qc->last_probertt_stamp = tcp_jiffies32;
@@ -640,7 +1676,28 @@ static void init_Q_cong(struct sock *sk)
 	qc->current_state[1] = 0;
 	qc->current_state[2] = 0;
 
-	qc->qtable = (Matrix *)kvmalloc( sizeof(Matrix), GFP_KERNEL);
+	qc->rule = update_rule;
+	qc->trace_len = 0;
+	qc->replay = replay && net_eq(sock_net(sk), &init_net);	// rings feed init_net's table only
+
+	// init may run in softirq for passive opens
+	qc->ext = kzalloc(sizeof(*qc->ext), GFP_ATOMIC);
+	if (qc->ext)
+	{
+		qc->ext->interval_min_rtt_us = U32_MAX;
+		qc->ext->prev_min_rtt_us = U32_MAX;
+		qc->ext->cadence_scale = CADENCE_NOMINAL;
+	}
+
+	// replay mode acts on the shared table, the worker is the only writer
+	if (qc->replay)
+	{
+		qc->rule = RULE_Q;
+		qc->qtable = &matrix;
+		return;
+	}
+
+	qc->qtable = (Matrix *)kvmalloc((qc->rule == RULE_DOUBLE_Q ? 2 : 1) * sizeof(Matrix), GFP_KERNEL);
 	if (!qc->qtable){
 		printk(KERN_INFO "init qtable error");
         return;
@@ -648,9 +1705,11 @@ static void init_Q_cong(struct sock *sk)
 	else{
 		// printk(KERN_INFO "qtable %p", qc->qtable);
 		printk(KERN_INFO "cp matrix to qtable : %p : start", qc->qtable);
-		read_lock(&qtable_lock);
-		memcpy(qc->qtable, &matrix, sizeof(Matrix));
-		read_unlock(&qtable_lock);
+		read_lock_bh(sn->lock);
+		memcpy(qc->qtable, sn->matrix, sizeof(Matrix));
+		if (qc->rule == RULE_DOUBLE_Q)
+			memcpy(qc->qtable + 1, sn->matrix_b, sizeof(Matrix));
+		read_unlock_bh(sn->lock);
 		printk(KERN_INFO "cp matrix to qtable : %p :  ok", qc->qtable);
 		printk(KERN_INFO "qtable col : %d", qc->qtable->col);
 		for(i=0;i<numOfState;i++){
@@ -663,11 +1722,21 @@ static void init_Q_cong(struct sock *sk)
 static void release_Q_cong(struct sock *sk)
 {	
 	struct Q_cong *qc = inet_csk_ca(sk);
+	struct satcc_net *sn = satcc_pernet(sock_net(sk));
+
+	kfree(qc->ext);
+	qc->ext = NULL;
+	if (qc->replay)
+		return;
 	if(qc->qtable){
 		printk(KERN_INFO "cp qtable to matrix : %p : start", qc->qtable);
-		write_lock(&qtable_lock);
-		memcpy(&matrix, qc->qtable, sizeof(Matrix));
-		write_unlock(&qtable_lock);
+		write_lock_bh(sn->lock);
+		memcpy(sn->matrix, qc->qtable, sizeof(Matrix));
+		if (qc->rule == RULE_DOUBLE_Q)
+			memcpy(sn->matrix_b, qc->qtable + 1, sizeof(Matrix));
+		// the rule of the flow, not the current update_rule, tells what matrix_b holds
+		sn->double_q = qc->rule == RULE_DOUBLE_Q;
+		write_unlock_bh(sn->lock);
 		printk(KERN_INFO "cp qtable to matrix : %p :  ok", qc->qtable);
 		kvfree(qc->qtable);
 	}else{
@@ -676,6 +1745,262 @@ static void release_Q_cong(struct sock *sk)
 	// eraseMatrix();
 }
 
+static struct ctl_table satcc_sysctl_table[] = {
+	{ .procname = "reward", .data = &satcc_defaults.reward, .maxlen = sizeof(unsigned int), .mode = 0644, .proc_handler = proc_douintvec },
+	{ .procname = "alpha", .data = &satcc_defaults.alpha, .maxlen = sizeof(unsigned int), .mode = 0644, .proc_handler = proc_douintvec },
+	{ .procname = "beta", .data = &satcc_defaults.beta, .maxlen = sizeof(unsigned int), .mode = 0644, .proc_handler = proc_douintvec },
+	{ .procname = "gamma", .data = &satcc_defaults.gamma, .maxlen = sizeof(unsigned int), .mode = 0644, .proc_handler = proc_douintvec },
+	{ .procname = "delay_target_ms", .data = &satcc_defaults.delay_target_ms, .maxlen = sizeof(unsigned int), .mode = 0644, .proc_handler = proc_douintvec },
+	{ .procname = "rate_bins", .data = &satcc_defaults.rate_bins, .maxlen = sizeof(unsigned int), .mode = 0644, .proc_handler = proc_douintvec },
+	{ .procname = "ce_weight", .data = &satcc_defaults.ce_weight, .maxlen = sizeof(unsigned int), .mode = 0644, .proc_handler = proc_douintvec },
+	{ }
+};
+
+#define QTABLE_FILE_MAX (sizeof(struct qtable_meta) + sizeof(Matrix) + sizeof(u16) * sizeOfMatrix)
+
+/*
+ * /proc/net/satcc_qtable: reading returns the namespace's learnt table with
+ * metadata and visit counts, writing a table file replaces it, so every
+ * namespace can train from its own starting point.
+ */
+struct satcc_qtable_file
+{
+	struct net *net;
+	size_t len;
+	bool loaded;
+	char buf[] __aligned(8);
+};
+
+static int satcc_load_table(struct satcc_qtable_file *f)
+{
+	struct satcc_net *sn = satcc_pernet(f->net);
+	struct qtable_meta *meta = (struct qtable_meta *)f->buf;
+	Matrix *m;
+	size_t offset = 0;
+	bool has_visits = false;
+
+	if (f->len >= sizeof(*meta) && meta->magic == QTABLE_MAGIC)
+	{
+		if (meta->size < offsetof(struct qtable_meta, reserved) || meta->size > sizeof(*meta) ||
+			meta->size % sizeof(u32))
+			return -EINVAL;
+		offset = meta->size;
+		has_visits = (meta->flags & QTABLE_VISITS) &&
+			f->len >= offset + sizeof(Matrix) + sizeof(u16) * sizeOfMatrix;
+	}
+	if (f->len < offset + sizeof(Matrix))
+		return -EINVAL;
+
+	m = (Matrix *)(f->buf + offset);
+	if (!matrix_layout_ok(m))
+		return -EINVAL;
+
+	if (offset)
+		sn->p->rate_bins = meta->flags & QTABLE_LOG_RATE ? RATE_BINS_LOG : RATE_BINS_LINEAR;
+	write_lock_bh(sn->lock);
+	memcpy(sn->matrix, m, sizeof(Matrix));
+	memcpy(sn->matrix_b, m, sizeof(Matrix));
+	sn->double_q = false;
+	if (has_visits)
+		memcpy(sn->visits, f->buf + offset + sizeof(Matrix), sizeof(u16) * sizeOfMatrix);
+	else
+		memset(sn->visits, 0, sizeof(u16) * sizeOfMatrix);
+	write_unlock_bh(sn->lock);
+	return 0;
+}
+
+static int satcc_qtable_open(struct inode *inode, struct file *file)
+{
+	struct satcc_qtable_file *f;
+	struct satcc_net *sn;
+	struct qtable_meta *meta;
+	Matrix *m;
+	u32 i;
+
+	f = vzalloc(sizeof(*f) + QTABLE_FILE_MAX);
+	if (!f)
+		return -ENOMEM;
+	f->net = PDE_DATA(inode);
+
+	if (!(file->f_mode & FMODE_WRITE))
+	{
+		sn = satcc_pernet(f->net);
+		meta = (struct qtable_meta *)f->buf;
+		m = (Matrix *)(f->buf + sizeof(*meta));
+		fill_meta(meta, sn->p);
+		meta->flags |= QTABLE_VISITS;
+		read_lock_bh(sn->lock);
+		memcpy(m, sn->matrix, sizeof(Matrix));
+		if (sn->double_q)
+		{
+			for (i = 0; i < sizeOfMatrix; i++)
+				m->mat[i] = (m->mat[i] + sn->matrix_b->mat[i]) / 2;
+		}
+		memcpy(m + 1, sn->visits, sizeof(u16) * sizeOfMatrix);
+		read_unlock_bh(sn->lock);
+		f->len = QTABLE_FILE_MAX;
+	}
+
+	file->private_data = f;
+	return 0;
+}
+
+static ssize_t satcc_qtable_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
+{
+	struct satcc_qtable_file *f = file->private_data;
+
+	if (file->f_mode & FMODE_WRITE)
+		return -EINVAL;
+	return simple_read_from_buffer(buf, count, ppos, f->buf, f->len);
+}
+
+static ssize_t satcc_qtable_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+	struct satcc_qtable_file *f = file->private_data;
+	ssize_t res;
+
+	res = simple_write_to_buffer(f->buf, QTABLE_FILE_MAX, ppos, buf, count);
+	if (res > 0)
+		f->len = max_t(size_t, f->len, *ppos);
+	return res;
+}
+
+/*
+ * The table is taken over once the whole file is written. Unlike
+ * ->release, ->flush reports to close(), so a rejected table fails it.
+ */
+static int satcc_qtable_flush(struct file *file, fl_owner_t id)
+{
+	struct satcc_qtable_file *f = file->private_data;
+	int err;
+
+	if (!(file->f_mode & FMODE_WRITE) || !f->len || f->loaded)
+		return 0;
+	err = satcc_load_table(f);
+	if (err)
+	{
+		printk(KERN_INFO "satcc_qtable: rejected table of %zu bytes", f->len);
+		return err;
+	}
+	f->loaded = true;
+	return 0;
+}
+
+static int satcc_qtable_release(struct inode *inode, struct file *file)
+{
+	vfree(file->private_data);
+	return 0;
+}
+
+static const struct file_operations satcc_qtable_fops = {
+	.owner = THIS_MODULE,
+	.open = satcc_qtable_open,
+	.read = satcc_qtable_read,
+	.write = satcc_qtable_write,
+	.llseek = default_llseek,
+	.flush = satcc_qtable_flush,
+	.release = satcc_qtable_release,
+};
+
+static int __net_init satcc_net_init(struct net *net)
+{
+	struct satcc_net *sn = satcc_pernet(net);
+	struct ctl_table *tbl = satcc_sysctl_table;
+	int i;
+
+	if (net_eq(net, &init_net))
+	{
+		sn->p = &satcc_defaults;
+		sn->matrix = &matrix;
+		sn->matrix_b = &matrix_b;
+		sn->visits = visits;
+		sn->lock = &qtable_lock;
+	}
+	else
+	{
+		sn->params = satcc_defaults;
+		sn->p = &sn->params;
+
+		// a new namespace starts from what init_net has learnt so far
+		sn->tables = vmalloc(sizeof(*sn->tables));
+		if (!sn->tables)
+			return -ENOMEM;
+		read_lock_bh(&qtable_lock);
+		memcpy(&sn->tables->matrix, &matrix, sizeof(Matrix));
+		memcpy(&sn->tables->matrix_b, &matrix_b, sizeof(Matrix));
+		memcpy(sn->tables->visits, visits, sizeof(visits));
+		sn->double_q = satcc_pernet(&init_net)->double_q;
+		read_unlock_bh(&qtable_lock);
+		sn->matrix = &sn->tables->matrix;
+		sn->matrix_b = &sn->tables->matrix_b;
+		sn->visits = sn->tables->visits;
+		rwlock_init(&sn->own_lock);
+		sn->lock = &sn->own_lock;
+
+		tbl = kmemdup(satcc_sysctl_table, sizeof(satcc_sysctl_table), GFP_KERNEL);
+		if (!tbl)
+			goto err_tbl;
+		for (i = 0; i < ARRAY_SIZE(satcc_sysctl_table) - 1; i++)
+			tbl[i].data += (void *)sn->p - (void *)&satcc_defaults;
+	}
+
+	sn->sysctl = register_net_sysctl(net, "net/satcc", tbl);
+	if (!sn->sysctl)
+		goto err_sysctl;
+
+	if (!proc_create_data("satcc_qtable", 0600, net->proc_net, &satcc_qtable_fops, net))
+		goto err_proc;
+
+	return 0;
+
+err_proc:
+	unregister_net_sysctl_table(sn->sysctl);
+err_sysctl:
+	if (tbl != satcc_sysctl_table)
+		kfree(tbl);
+err_tbl:
+	vfree(sn->tables);
+	return -ENOMEM;
+}
+
+static void __net_exit satcc_net_exit(struct net *net)
+{
+	struct satcc_net *sn = satcc_pernet(net);
+	struct ctl_table *tbl = sn->sysctl->ctl_table_arg;
+
+	remove_proc_entry("satcc_qtable", net->proc_net);
+	unregister_net_sysctl_table(sn->sysctl);
+	if (!net_eq(net, &init_net))
+	{
+		kfree(tbl);
+		vfree(sn->tables);
+	}
+}
+
+static struct pernet_operations satcc_net_ops = {
+	.init = satcc_net_init,
+	.exit = satcc_net_exit,
+	.id = &satcc_net_id,
+	.size = sizeof(struct satcc_net),
+};
+
+// reported in the tcpvegas_info layout, as tcp_illinois does
+static size_t q_cong_get_info(struct sock *sk, u32 ext, int *attr, union tcp_cc_info *info)
+{
+	struct Q_cong *qc = inet_csk_ca(sk);
+
+	if (ext & (1 << (INET_DIAG_VEGASINFO - 1)))
+	{
+		info->vegas.tcpv_enabled = qc->ext ? qc->ext->decisions : 0;
+		info->vegas.tcpv_rttcnt = qc->ext ? qc->ext->fallbacks : 0;	// decisions taken by fallback_action()
+		info->vegas.tcpv_rtt = tcp_sk(sk)->srtt_us >> 3;
+		info->vegas.tcpv_minrtt = qc->min_rtt_us;
+		*attr = INET_DIAG_VEGASINFO;
+		return sizeof(struct tcpvegas_info);
+	}
+	return 0;
+}
+
 struct tcp_congestion_ops q_cong = {
 	.flags = TCP_CONG_NON_RESTRICTED,
 	.init = init_Q_cong,
@@ -684,25 +2009,118 @@ struct tcp_congestion_ops q_cong = {
 	.owner = THIS_MODULE,
 	.ssthresh = q_cong_ssthresh,
 	.cong_control = q_cong_main,
+	.in_ack_event = q_cong_in_ack_event,
+	.cwnd_event = q_cong_cwnd_event,
 	.undo_cwnd = q_cong_undo_cwnd,
+	.set_state = q_cong_set_state,
+	.get_info = q_cong_get_info,
 };
 
 static int __init Q_cong_init(void)
 {	
 	int i;
-	read_Matrix(&matrix);
+	int ret;
+	struct qtable_meta meta;
+	u16 Q_row[numOfState] = {state0_max, state1_max, state2_max};
+	int has_meta;
+
+	has_meta = read_Matrix(&matrix, &meta);
+	if (!matrix.col)
+		createMatrix(&matrix, Q_row, numOfAction);	// no table yet, start blank
+	else if (!matrix_layout_ok(&matrix))
+	{
+		printk(KERN_ERR "qtable is %ux%ux%ux%u, this build needs %ux%ux%ux%u",
+			   matrix.row[0], matrix.row[1], matrix.row[2], matrix.col,
+			   state0_max, state1_max, state2_max, numOfAction);
+		return -EINVAL;
+	}
+	if (has_meta)
+	{
+		printk(KERN_INFO "qtable trained with reward %u (%u,%u,%u,%u) lr %u discount %u rule %u",
+			   meta.reward, meta.alpha, meta.beta, meta.gamma, meta.delay_target_ms,
+			   meta.learning_rate, meta.discount_factor, meta.update_rule);
+		if (meta.reward != satcc_defaults.reward || meta.alpha != satcc_defaults.alpha ||
+			meta.beta != satcc_defaults.beta || meta.gamma != satcc_defaults.gamma)
+			printk(KERN_WARNING "qtable was trained with another reward, continuing with the current one");
+		// the axis layout is part of the table, unlike the reward
+		satcc_defaults.rate_bins = meta.flags & QTABLE_LOG_RATE ? RATE_BINS_LOG : RATE_BINS_LINEAR;
+	}
+	memcpy(&matrix_b, &matrix, sizeof(Matrix));
 	printk(KERN_INFO "qtable col : %d", matrix.col);
 	for(i=0;i<numOfState;i++){
 		printk(KERN_INFO "qtable row%d : %d", i, matrix.row[i]);
 	}
 	BUILD_BUG_ON(sizeof(struct Q_cong) > ICSK_CA_PRIV_SIZE); 
-	return tcp_register_congestion_control(&q_cong);
+
+	replay_rings = alloc_percpu(struct replay_ring);
+	if (!replay_rings)
+		return -ENOMEM;
+
+	if (ecn)
+		q_cong.flags |= TCP_CONG_NEEDS_ECN;
+
+	// planning acts on the shared table, which only replay mode learns on
+	if (dyna && !replay)
+		printk(KERN_WARNING "dyna needs replay, planning disabled");
+	if (dyna && replay)
+	{
+		model = vzalloc(sizeof(*model));
+		if (!model)
+		{
+			ret = -ENOMEM;
+			goto err_pernet;
+		}
+		dyna_thread = kthread_run(dyna_fn, NULL, "satcc_dyna");
+		if (IS_ERR(dyna_thread))
+		{
+			ret = PTR_ERR(dyna_thread);
+			dyna_thread = NULL;
+			goto err_model;
+		}
+	}
+
+	ret = register_pernet_subsys(&satcc_net_ops);
+	if (ret)
+		goto err_thread;
+
+	ret = tcp_register_congestion_control(&q_cong);
+	if (ret)
+		goto err_register;
+	return 0;
+
+err_register:
+	unregister_pernet_subsys(&satcc_net_ops);
+err_thread:
+	if (dyna_thread)
+		kthread_stop(dyna_thread);
+err_model:
+	vfree(model);
+err_pernet:
+	free_percpu(replay_rings);
+	return ret;
 }
 
 static void __exit Q_cong_exit(void)
 {
+	u32 i;
+
+	// no flow is left to enqueue, apply what is still queued before saving
+	cancel_work_sync(&replay_work);
+	replay_work_fn(NULL);
+	free_percpu(replay_rings);
+	if (dyna_thread)
+		kthread_stop(dyna_thread);
+	vfree(model);
+
+	// Double Q: the saved policy is the mean of both tables
+	if (satcc_pernet(&init_net)->double_q)
+	{
+		for (i = 0; i < sizeOfMatrix; i++)
+			matrix.mat[i] = (matrix.mat[i] + matrix_b.mat[i]) / 2;
+	}
 	save_Matrix(&matrix);
 	tcp_unregister_congestion_control(&q_cong);
+	unregister_pernet_subsys(&satcc_net_ops);
 }
 
 module_init(Q_cong_init);
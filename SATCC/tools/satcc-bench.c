@@ -0,0 +1,458 @@
+/*
+ * satcc-bench: connection-scale benchmark for tcp_satcc.ko.
+ *
+ * Opens and holds N connections over loopback with the congestion control
+ * set on both ends, optionally churns them and pushes bulk traffic over a
+ * subset, then closes them all. Reports kernel memory per connection,
+ * connect/accept latency percentiles, softirq CPU per Gbit/s and close
+ * cost as one JSON line per N, so runs can be compared across commits.
+ *
+ * Run it in a fresh namespace (unshare -n, after ip link set lo up) to
+ * keep other traffic and TIME_WAIT sockets of earlier runs out of the
+ * numbers; the module's per-namespace table is then the only one loaded.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define PORTS_PER_LISTENER	20000	// stay well inside the ephemeral range per destination
+#define MAX_LISTENERS		64
+#define PUMP_CHUNK		65536
+
+struct conn
+{
+	int client;
+	int server;
+};
+
+struct mem
+{
+	long slab_kb;
+	long sunreclaim_kb;
+	long vmalloc_kb;
+	long available_kb;
+};
+
+struct bench
+{
+	const char *cc;
+	const char *label;
+	int base_port;
+	int hold_s;
+	int churn;		// connections closed and reopened per second while holding
+	int active;		// connections carrying bulk traffic while holding
+	int listeners;
+	int lfd[MAX_LISTENERS];
+	struct sockaddr_in addr;
+	uint32_t *connect_ns;
+	uint32_t *accept_ns;
+	size_t samples;
+	size_t capacity;
+};
+
+static char pump_buf[PUMP_CHUNK];
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until_ns(uint64_t t)
+{
+	struct timespec ts = { .tv_sec = t / 1000000000ULL, .tv_nsec = t % 1000000000ULL };
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+static void read_mem(struct mem *m)
+{
+	char line[256];
+	FILE *fp;
+
+	memset(m, 0, sizeof(*m));
+	fp = fopen("/proc/meminfo", "r");
+	if (!fp)
+		return;
+	while (fgets(line, sizeof(line), fp))
+	{
+		sscanf(line, "Slab: %ld", &m->slab_kb);
+		sscanf(line, "SUnreclaim: %ld", &m->sunreclaim_kb);
+		sscanf(line, "VmallocUsed: %ld", &m->vmalloc_kb);
+		sscanf(line, "MemAvailable: %ld", &m->available_kb);
+	}
+	fclose(fp);
+}
+
+// softirq time of all CPUs, in clock ticks
+static unsigned long long read_softirq(void)
+{
+	unsigned long long v[7] = {0};
+	FILE *fp;
+
+	fp = fopen("/proc/stat", "r");
+	if (!fp)
+		return 0;
+	if (fscanf(fp, "cpu %llu %llu %llu %llu %llu %llu %llu",
+			&v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6]) != 7)
+		v[6] = 0;
+	fclose(fp);
+	return v[6];
+}
+
+static int set_cc(int fd, const char *cc)
+{
+	if (setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, cc, strlen(cc)) < 0)
+	{
+		fprintf(stderr, "TCP_CONGESTION %s: %s\n", cc, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static int open_listeners(struct bench *b, size_t n)
+{
+	struct sockaddr_in addr = b->addr;
+	int one = 1;
+	int i;
+
+	b->listeners = n / PORTS_PER_LISTENER + 1;
+	if (b->listeners > MAX_LISTENERS)
+	{
+		fprintf(stderr, "%zu connections need more than %d listeners\n", n, MAX_LISTENERS);
+		return -1;
+	}
+	for (i = 0; i < b->listeners; i++)
+	{
+		b->lfd[i] = socket(AF_INET, SOCK_STREAM, 0);
+		if (b->lfd[i] < 0)
+			goto err;
+		setsockopt(b->lfd[i], SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		addr.sin_port = htons(b->base_port + i);
+		if (set_cc(b->lfd[i], b->cc) < 0 ||
+			bind(b->lfd[i], (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+			listen(b->lfd[i], 4096) < 0)
+		{
+			i++;
+			goto err;
+		}
+	}
+	return 0;
+
+err:
+	perror("listen");
+	while (i-- > 0)
+		close(b->lfd[i]);
+	b->listeners = 0;
+	return -1;
+}
+
+static void close_listeners(struct bench *b)
+{
+	int i;
+
+	for (i = 0; i < b->listeners; i++)
+		close(b->lfd[i]);
+	b->listeners = 0;
+}
+
+// connect slot i and accept its peer, recording both latencies
+static int open_conn(struct bench *b, struct conn *c, size_t i)
+{
+	struct sockaddr_in addr = b->addr;
+	int l = i % b->listeners;
+	uint64_t t0, t1, t2;
+
+	c->client = socket(AF_INET, SOCK_STREAM, 0);
+	if (c->client < 0)
+		return -1;
+	if (set_cc(c->client, b->cc) < 0)
+		goto err;
+	addr.sin_port = htons(b->base_port + l);
+
+	t0 = now_ns();
+	if (connect(c->client, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		goto err;
+	t1 = now_ns();
+	c->server = accept(b->lfd[l], NULL, NULL);
+	if (c->server < 0)
+		goto err;
+	t2 = now_ns();
+
+	if (b->samples < b->capacity)
+	{
+		b->connect_ns[b->samples] = t1 - t0 > UINT32_MAX ? UINT32_MAX : t1 - t0;
+		b->accept_ns[b->samples] = t2 - t1 > UINT32_MAX ? UINT32_MAX : t2 - t1;
+		b->samples++;
+	}
+
+	fcntl(c->client, F_SETFL, O_NONBLOCK);
+	fcntl(c->server, F_SETFL, O_NONBLOCK);
+	return 0;
+
+err:
+	close(c->client);
+	c->client = -1;
+	return -1;
+}
+
+// the server side closes first, so TIME_WAIT does not hold client ports
+static void close_conn(struct conn *c)
+{
+	close(c->server);
+	close(c->client);
+	c->server = c->client = -1;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void print_percentiles(const char *name, uint32_t *v, size_t n)
+{
+	qsort(v, n, sizeof(*v), cmp_u32);
+	printf("\"%s\":{\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}", name,
+		n ? v[n / 2] / 1000.0 : 0, n ? v[n * 9 / 10] / 1000.0 : 0,
+		n ? v[n * 99 / 100] / 1000.0 : 0, n ? v[n * 999 / 1000] / 1000.0 : 0,
+		n ? v[n - 1] / 1000.0 : 0);
+}
+
+// push bulk data from client to server on the first b->active connections
+static uint64_t pump(struct bench *b, struct conn *conns, size_t n)
+{
+	uint64_t bytes = 0;
+	ssize_t r;
+	size_t i;
+
+	for (i = 0; i < n && i < (size_t)b->active; i++)
+	{
+		if (conns[i].client < 0)
+			continue;
+		send(conns[i].client, pump_buf, sizeof(pump_buf), MSG_DONTWAIT);
+		while ((r = recv(conns[i].server, pump_buf, sizeof(pump_buf), MSG_DONTWAIT)) > 0)
+			bytes += r;
+	}
+	return bytes;
+}
+
+static int run(struct bench *b, size_t n)
+{
+	struct conn *conns;
+	struct mem m0, m1, m2;
+	unsigned long long si0, si1;
+	uint64_t t0, t1, end, wake, next_churn, bytes = 0;
+	double hold_s, gbps, softirq_s, close_us;
+	size_t opened, churned = 0, victim = 0;
+	int ret = 0;
+
+	conns = calloc(n, sizeof(*conns));
+	b->capacity = n + (size_t)b->churn * b->hold_s;
+	b->connect_ns = calloc(b->capacity, sizeof(uint32_t));
+	b->accept_ns = calloc(b->capacity, sizeof(uint32_t));
+	b->samples = 0;
+	if (!conns || !b->connect_ns || !b->accept_ns)
+	{
+		fprintf(stderr, "out of memory\n");
+		ret = -1;
+		goto out;
+	}
+	if (open_listeners(b, n) < 0)
+	{
+		ret = -1;
+		goto out;
+	}
+
+	read_mem(&m0);
+	for (opened = 0; opened < n; opened++)
+	{
+		if (open_conn(b, &conns[opened], opened) < 0)
+		{
+			fprintf(stderr, "connection %zu: %s\n", opened, strerror(errno));
+			ret = -1;
+			break;
+		}
+	}
+	read_mem(&m1);
+
+	// hold: churn and pump until the hold time is over
+	si0 = read_softirq();
+	t0 = now_ns();
+	end = t0 + (uint64_t)b->hold_s * 1000000000ULL;
+	next_churn = t0;
+	while ((t1 = now_ns()) < end)
+	{
+		if (b->churn && opened && t1 >= next_churn)
+		{
+			// churn the held connections, not the ones carrying traffic
+			victim = b->active < (int)opened ? b->active + churned % (opened - b->active) : churned % opened;
+			close_conn(&conns[victim]);
+			if (open_conn(b, &conns[victim], victim) == 0)
+				churned++;
+			next_churn += 1000000000ULL / b->churn;
+		}
+		if (b->active)
+		{
+			bytes += pump(b, conns, opened);
+			continue;
+		}
+		// nothing to pump: sleep to the next churn instead of spinning on the clock
+		wake = b->churn && opened ? next_churn : t1 + 10000000ULL;
+		sleep_until_ns(wake < end ? wake : end);
+	}
+	si1 = read_softirq();
+	hold_s = (t1 - t0) / 1e9;
+
+	t0 = now_ns();
+	for (victim = 0; victim < opened; victim++)
+	{
+		if (conns[victim].client >= 0)
+			close_conn(&conns[victim]);
+	}
+	t1 = now_ns();
+	close_us = (t1 - t0) / 1e3;
+	close_listeners(b);
+	sleep(1);	// let the release path and RCU callbacks run
+	read_mem(&m2);
+
+	gbps = hold_s > 0 ? bytes * 8 / hold_s / 1e9 : 0;	// -d 0 holds for no time at all
+	softirq_s = (si1 - si0) / (double)sysconf(_SC_CLK_TCK);
+
+	printf("{\"label\":\"%s\",\"cc\":\"%s\",\"n\":%zu,\"opened\":%zu,\"churned\":%zu,\"active\":%d,",
+		b->label, b->cc, n, opened, churned, b->active);
+	print_percentiles("connect_us", b->connect_ns, b->samples);
+	printf(",");
+	print_percentiles("accept_us", b->accept_ns, b->samples);
+	printf(",\"slab_kb\":%ld,\"sunreclaim_kb\":%ld,\"vmalloc_kb\":%ld,\"mem_kb\":%ld,"
+		"\"bytes_per_conn\":%.0f,\"leaked_kb\":%ld,",
+		m1.slab_kb - m0.slab_kb, m1.sunreclaim_kb - m0.sunreclaim_kb,
+		m1.vmalloc_kb - m0.vmalloc_kb, m0.available_kb - m1.available_kb,
+		opened ? (m0.available_kb - m1.available_kb) * 1024.0 / opened : 0,
+		m0.available_kb - m2.available_kb);
+	printf("\"gbps\":%.3f,\"softirq_s_per_gbps\":%.4f,\"close_us\":%.0f,\"close_us_per_conn\":%.2f}\n",
+		gbps, gbps > 0 ? softirq_s / hold_s / gbps : 0, close_us, opened ? close_us / opened : 0);
+	fflush(stdout);
+
+out:
+	free(conns);
+	free(b->connect_ns);
+	free(b->accept_ns);
+	return ret;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+			"usage: satcc-bench [-n N[,N...]] [-d HOLD_S] [-c CHURN] [-a ACTIVE]\n"
+			"                   [-C CC] [-p PORT] [-l LABEL]\n"
+			"\n"
+			"Opens N connections over 127.0.0.1 with congestion control CC (satcc),\n"
+			"holds them for HOLD_S seconds (5) while closing and reopening CHURN of\n"
+			"them per second (0) and pushing bulk data over ACTIVE of them (0), then\n"
+			"closes them. Listeners use PORT (40000) upwards, one per %d connections.\n"
+			"Prints one JSON line per N, tagged with LABEL (e.g. git describe).\n",
+			PORTS_PER_LISTENER);
+}
+
+int main(int argc, char **argv)
+{
+	struct bench b = {
+		.cc = "satcc",
+		.label = "",
+		.base_port = 40000,
+		.hold_s = 5,
+	};
+	const char *counts = "10000";
+	char *list, *tok;
+	struct rlimit rl;
+	rlim_t want;
+	size_t n, max_n = 0;
+	int opt;
+	int ret = 0;
+
+	while ((opt = getopt(argc, argv, "n:d:c:a:C:p:l:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'n':
+			counts = optarg;
+			break;
+		case 'd':
+			b.hold_s = atoi(optarg);
+			break;
+		case 'c':
+			b.churn = atoi(optarg);
+			break;
+		case 'a':
+			b.active = atoi(optarg);
+			break;
+		case 'C':
+			b.cc = optarg;
+			break;
+		case 'p':
+			b.base_port = atoi(optarg);
+			break;
+		case 'l':
+			b.label = optarg;
+			break;
+		default:
+			usage();
+			return 2;
+		}
+	}
+	if (optind != argc || b.hold_s < 0 || b.churn < 0 || b.active < 0)
+	{
+		usage();
+		return 2;
+	}
+
+	list = strdup(counts);
+	for (tok = strtok(list, ","); tok; tok = strtok(NULL, ","))
+	{
+		n = strtoul(tok, NULL, 0);
+		if (n > max_n)
+			max_n = n;
+	}
+
+	// two descriptors per connection plus the listeners, up to the hard limit
+	want = 2 * max_n + MAX_LISTENERS + 64;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < want)
+	{
+		if (rl.rlim_max != RLIM_INFINITY && rl.rlim_max < want)
+			fprintf(stderr, "RLIMIT_NOFILE hard limit %lu is below %lu, larger N will fail\n",
+				(unsigned long)rl.rlim_max, (unsigned long)want);
+		rl.rlim_cur = rl.rlim_max != RLIM_INFINITY && rl.rlim_max < want ? rl.rlim_max : want;
+		if (setrlimit(RLIMIT_NOFILE, &rl) < 0)
+			fprintf(stderr, "RLIMIT_NOFILE %lu: %s\n", (unsigned long)rl.rlim_cur, strerror(errno));
+	}
+
+	b.addr.sin_family = AF_INET;
+	b.addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	strcpy(list, counts);
+	for (tok = strtok(list, ","); tok; tok = strtok(NULL, ","))
+	{
+		n = strtoul(tok, NULL, 0);
+		if (n && run(&b, n) < 0)
+			ret = 1;
+	}
+	free(list);
+	return ret;
+}
@@ -0,0 +1,531 @@
+/*
+ * satcc-ctl: inspect, diff, merge and convert SATCC Q-table files.
+ *
+ * Reads both the metadata format written by the modules and bare Matrix
+ * dumps of older releases. Every command streams one table at a time.
+ */
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <getopt.h>
+
+#include "../satcc_qtable.h"
+
+struct table
+{
+	struct qtable_meta meta;
+	int has_meta;
+	int has_visits;
+	Matrix m;
+	u16 visits[sizeOfMatrix];
+};
+
+static const char action_chars[numOfAction] = {'U', 'D', '-'};
+static const char *action_names[numOfAction] = {"CWND_UP", "CWND_DOWN", "CWND_NOTHING"};
+
+static int load_table(const char *path, struct table *t)
+{
+	FILE *fp;
+	long size;
+
+	fp = fopen(path, "rb");
+	if (!fp)
+	{
+		perror(path);
+		return -1;
+	}
+
+	memset(&t->meta, 0, sizeof(t->meta));
+	t->has_meta = 0;
+	t->has_visits = 0;
+
+	if (fread(&t->meta, 1, sizeof(t->meta), fp) == sizeof(t->meta) &&
+		t->meta.magic == QTABLE_MAGIC && t->meta.size >= offsetof(struct qtable_meta, reserved))
+	{
+		if (t->meta.size > sizeof(t->meta) || t->meta.size % sizeof(u32))
+		{
+			fprintf(stderr, "%s: metadata size %u, this build has %zu\n", path,
+					t->meta.size, sizeof(t->meta));
+			fclose(fp);
+			return -1;
+		}
+		t->has_meta = 1;
+		size = t->meta.size;
+		if (t->meta.size < sizeof(t->meta))
+			memset((char *)&t->meta + t->meta.size, 0, sizeof(t->meta) - t->meta.size);
+	}
+	else
+	{
+		memset(&t->meta, 0, sizeof(t->meta));
+		size = 0;
+	}
+
+	if (fseek(fp, size, SEEK_SET) || fread(&t->m, 1, sizeof(Matrix), fp) != sizeof(Matrix))
+	{
+		fprintf(stderr, "%s: short table\n", path);
+		fclose(fp);
+		return -1;
+	}
+
+	if (t->has_meta && (t->meta.flags & QTABLE_VISITS))
+	{
+		if (fread(t->visits, 1, sizeof(t->visits), fp) != sizeof(t->visits))
+		{
+			fprintf(stderr, "%s: short visit counts\n", path);
+			fclose(fp);
+			return -1;
+		}
+		t->has_visits = 1;
+	}
+	else
+		memset(t->visits, 0, sizeof(t->visits));
+
+	/* the modules only load tables of their own build, so neither do we */
+	if (fgetc(fp) != EOF)
+	{
+		fprintf(stderr, "%s: trailing data, table of a different build\n", path);
+		fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+
+	if (t->m.col != numOfAction || t->m.row[0] != state0_max || t->m.row[1] != state1_max ||
+		t->m.row[2] != state2_max)
+	{
+		fprintf(stderr, "%s: dimensions %ux%ux%u x %u, this build has %ux%ux%u x %u\n", path,
+				t->m.row[0], t->m.row[1], t->m.row[2], t->m.col,
+				state0_max, state1_max, state2_max, numOfAction);
+		return -1;
+	}
+	return 0;
+}
+
+static int save_table(const char *path, struct table *t, const char *format)
+{
+	FILE *fp;
+	u32 s0, s1, s2, a, index;
+	int ok = 1;
+
+	fp = fopen(path, "wb");
+	if (!fp)
+	{
+		perror(path);
+		return -1;
+	}
+
+	if (!strcmp(format, "csv"))
+	{
+		fprintf(fp, "throughput,delay,more,action,q,visits\n");
+		for (s0 = 0; s0 < t->m.row[0]; s0++)
+			for (s1 = 0; s1 < t->m.row[1]; s1++)
+				for (s2 = 0; s2 < t->m.row[2]; s2++)
+					for (a = 0; a < t->m.col; a++)
+					{
+						index = t->m.col * (s0 * t->m.row[1] * t->m.row[2] + s1 * t->m.row[2] + s2) + a;
+						fprintf(fp, "%u,%u,%u,%u,%d,%u\n", s0, s1, s2, a, t->m.mat[index], t->visits[index]);
+					}
+	}
+	else if (!strcmp(format, "legacy"))
+	{
+		ok = fwrite(&t->m, sizeof(Matrix), 1, fp) == 1;
+	}
+	else
+	{
+		if (!t->has_meta)
+		{
+			memset(&t->meta, 0, sizeof(t->meta));
+			t->meta.magic = QTABLE_MAGIC;
+			t->meta.version = QTABLE_VERSION;
+		}
+		t->meta.size = sizeof(t->meta);
+		t->meta.flags = t->has_visits ? (t->meta.flags | QTABLE_VISITS) : (t->meta.flags & ~QTABLE_VISITS);
+		ok = fwrite(&t->meta, sizeof(t->meta), 1, fp) == 1 &&
+			 fwrite(&t->m, sizeof(Matrix), 1, fp) == 1 &&
+			 (!t->has_visits || fwrite(t->visits, sizeof(t->visits), 1, fp) == 1);
+	}
+
+	if (fclose(fp) || !ok)
+	{
+		fprintf(stderr, "%s: write error\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+static u32 state_index(Matrix *m, u32 s0, u32 s1, u32 s2)
+{
+	return m->col * (s0 * m->row[1] * m->row[2] + s1 * m->row[2] + s2);
+}
+
+/* greedy action of a state, -1 when all actions are equal (unvisited) */
+static int greedy_action(Matrix *m, u32 s0, u32 s1, u32 s2, int *best)
+{
+	u32 base = state_index(m, s0, s1, s2);
+	int max_index = 0;
+	int is_equal = 1;
+	u32 a;
+
+	for (a = 1; a < m->col; a++)
+	{
+		if (m->mat[base + a] != m->mat[base])
+			is_equal = 0;
+		if (m->mat[base + a] > m->mat[base + max_index])
+			max_index = a;
+	}
+	if (best)
+		*best = m->mat[base + max_index];
+	return is_equal ? -1 : max_index;
+}
+
+static const char *reward_name(u32 reward)
+{
+	static const char *names[REWARD_MAX] = {"satcc", "power", "log-utility", "delay-target"};
+
+	return reward < REWARD_MAX ? names[reward] : "unknown";
+}
+
+static int cmd_info(int argc, char **argv)
+{
+	static struct table t;
+	u32 n, i, visited, visits;
+	u32 s0, s1, s2;
+	u32 policy[numOfAction + 1];
+	long long sum;
+	int min, max, a;
+
+	for (; argc > 0; argc--, argv++)
+	{
+		if (load_table(argv[0], &t))
+			return 1;
+
+		n = t.m.row[0] * t.m.row[1] * t.m.row[2] * t.m.col;
+		min = INT_MAX;
+		max = INT_MIN;
+		sum = 0;
+		visited = 0;
+		visits = 0;
+		for (i = 0; i < n; i++)
+		{
+			min = t.m.mat[i] < min ? t.m.mat[i] : min;
+			max = t.m.mat[i] > max ? t.m.mat[i] : max;
+			sum += t.m.mat[i];
+			visited += t.m.mat[i] != 0;
+			visits += t.visits[i];
+		}
+
+		memset(policy, 0, sizeof(policy));
+		for (s0 = 0; s0 < t.m.row[0]; s0++)
+			for (s1 = 0; s1 < t.m.row[1]; s1++)
+				for (s2 = 0; s2 < t.m.row[2]; s2++)
+				{
+					a = greedy_action(&t.m, s0, s1, s2, NULL);
+					policy[a < 0 ? numOfAction : a]++;
+				}
+
+		printf("%s:\n", argv[0]);
+		printf("  format      %s\n", t.has_meta ? "v1" : "legacy");
+		printf("  dimensions  %u x %u x %u states, %u actions\n", t.m.row[0], t.m.row[1], t.m.row[2], t.m.col);
+		if (t.has_meta)
+		{
+			printf("  reward      %s alpha %u beta %u gamma %u delay_target_ms %u ce_weight %u\n",
+				   reward_name(t.meta.reward), t.meta.alpha, t.meta.beta, t.meta.gamma,
+				   t.meta.delay_target_ms, t.meta.ce_weight);
+			printf("  throughput  %s bins\n", t.meta.flags & QTABLE_LOG_RATE ? "log" : "linear");
+			printf("  learning    rate %u/1024 discount %u/16 rule %u\n",
+				   t.meta.learning_rate, t.meta.discount_factor, t.meta.update_rule);
+		}
+		printf("  values      min %d max %d mean %.2f nonzero %u/%u\n", min, max, (double)sum / n, visited, n);
+		if (t.has_visits)
+			printf("  visits      %u\n", visits);
+		printf("  policy     ");
+		for (a = 0; a < numOfAction; a++)
+			printf(" %s %u", action_names[a], policy[a]);
+		printf(" unvisited %u\n", policy[numOfAction]);
+	}
+	return 0;
+}
+
+/* one row per delay bin, one column per throughput bin, of each "more" slice */
+static int cmd_policy(int argc, char **argv, int heatmap)
+{
+	static struct table t;
+	static const char ramp[] = " .:-=+*#%@";
+	u32 s0, s1, s2;
+	int best, min, max, a;
+
+	if (argc != 1)
+		return -1;
+	if (load_table(argv[0], &t))
+		return 1;
+
+	min = INT_MAX;
+	max = INT_MIN;
+	for (s0 = 0; s0 < t.m.row[0] * t.m.row[1] * t.m.row[2]; s0++)
+	{
+		greedy_action(&t.m, s0 / (t.m.row[1] * t.m.row[2]), s0 / t.m.row[2] % t.m.row[1], s0 % t.m.row[2], &best);
+		min = best < min ? best : min;
+		max = best > max ? best : max;
+	}
+
+	for (s2 = 0; s2 < t.m.row[2]; s2++)
+	{
+		printf("more=%u  x: throughput bin 0..%u  y: delay bin 0..%u\n", s2, t.m.row[0] - 1, t.m.row[1] - 1);
+		if (heatmap)
+			printf("max Q: '%c' %d .. '%c' %d\n", ramp[0], min, ramp[sizeof(ramp) - 2], max);
+		else
+			printf("U CWND_UP, D CWND_DOWN, - CWND_NOTHING, . unvisited\n");
+
+		for (s1 = 0; s1 < t.m.row[1]; s1++)
+		{
+			printf("%3u ", s1);
+			for (s0 = 0; s0 < t.m.row[0]; s0++)
+			{
+				a = greedy_action(&t.m, s0, s1, s2, &best);
+				if (heatmap)
+					putchar(ramp[max > min ? (long long)(best - min) * (sizeof(ramp) - 2) / (max - min) : 0]);
+				else
+					putchar(a < 0 ? '.' : action_chars[a]);
+			}
+			putchar('\n');
+		}
+	}
+	return 0;
+}
+
+static int cmd_diff(int argc, char **argv)
+{
+	static struct table a, b;
+	u32 pairs[numOfAction + 1][numOfAction + 1];
+	u32 s0, s1, s2, n, differ;
+	int x, y, verbose = 0;
+
+	if (argc == 3 && !strcmp(argv[0], "-v"))
+	{
+		verbose = 1;
+		argc--;
+		argv++;
+	}
+	if (argc != 2)
+		return -1;
+	// like diff(1): 1 means the policies differ, 2 that they could not be compared
+	if (load_table(argv[0], &a) || load_table(argv[1], &b))
+		return 2;
+	if (memcmp(a.m.row, b.m.row, sizeof(a.m.row)) || a.m.col != b.m.col)
+	{
+		fprintf(stderr, "tables have different dimensions\n");
+		return 2;
+	}
+
+	memset(pairs, 0, sizeof(pairs));
+	n = 0;
+	differ = 0;
+	for (s2 = 0; s2 < a.m.row[2]; s2++)
+		for (s1 = 0; s1 < a.m.row[1]; s1++)
+		{
+			if (verbose)
+				printf("%3u ", s1);
+			for (s0 = 0; s0 < a.m.row[0]; s0++)
+			{
+				x = greedy_action(&a.m, s0, s1, s2, NULL);
+				y = greedy_action(&b.m, s0, s1, s2, NULL);
+				x = x < 0 ? numOfAction : x;
+				y = y < 0 ? numOfAction : y;
+				pairs[x][y]++;
+				n++;
+				differ += x != y;
+				if (verbose)
+					putchar(x == y ? ' ' : (y == numOfAction ? '.' : action_chars[y]));
+			}
+			if (verbose)
+				putchar('\n');
+		}
+
+	printf("policy disagreement %u/%u states (%.2f%%)\n", differ, n, 100.0 * differ / n);
+	printf("%-14s", "A \\ B");
+	for (y = 0; y <= numOfAction; y++)
+		printf("%14s", y < numOfAction ? action_names[y] : "unvisited");
+	putchar('\n');
+	for (x = 0; x <= numOfAction; x++)
+	{
+		printf("%-14s", x < numOfAction ? action_names[x] : "unvisited");
+		for (y = 0; y <= numOfAction; y++)
+			printf("%14u", pairs[x][y]);
+		putchar('\n');
+	}
+	return differ != 0;
+}
+
+/*
+ * visit-weighted mean of the tables, equal weights for tables without visits;
+ * entries no table visited get the plain mean
+ */
+static int cmd_merge(int argc, char **argv, const char *out, const char *format)
+{
+	static struct table t, merged;
+	static long long sum[sizeOfMatrix];
+	static unsigned long long weight[sizeOfMatrix];
+	static unsigned long long visits[sizeOfMatrix];
+	static long long plain[sizeOfMatrix];
+	u32 i, n = sizeOfMatrix, w;
+	int f;
+
+	if (argc < 1 || !out)
+		return -1;
+
+	for (f = 0; f < argc; f++)
+	{
+		if (load_table(argv[f], &t))
+			return 1;
+		if (f == 0)
+			merged = t;
+		else if (memcmp(t.m.row, merged.m.row, sizeof(t.m.row)) || t.m.col != merged.m.col)
+		{
+			fprintf(stderr, "%s: dimensions differ from %s\n", argv[f], argv[0]);
+			return 1;
+		}
+		else if ((t.meta.flags ^ merged.meta.flags) & QTABLE_LOG_RATE)
+		{
+			fprintf(stderr, "%s: throughput bins differ from %s\n", argv[f], argv[0]);
+			return 1;
+		}
+
+		n = t.m.row[0] * t.m.row[1] * t.m.row[2] * t.m.col;
+		merged.has_visits |= t.has_visits;
+		for (i = 0; i < n; i++)
+		{
+			w = t.has_visits ? t.visits[i] : 1;
+			sum[i] += (long long)t.m.mat[i] * w;
+			weight[i] += w;
+			plain[i] += t.m.mat[i];
+			visits[i] += t.visits[i];
+		}
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		merged.m.mat[i] = weight[i] ? sum[i] / (long long)weight[i] : plain[i] / argc;
+		merged.visits[i] = visits[i] > UINT16_MAX ? UINT16_MAX : visits[i];
+	}
+	return save_table(out, &merged, format) ? 1 : 0;
+}
+
+static int cmd_convert(int argc, char **argv, const char *format, int shift)
+{
+	static struct table t;
+	long long v;
+	u32 i;
+
+	if (argc != 2)
+		return -1;
+	if (load_table(argv[0], &t))
+		return 1;
+
+	for (i = 0; shift && i < sizeOfMatrix; i++)
+	{
+		v = shift > 0 ? (long long)t.m.mat[i] << shift : t.m.mat[i] / (1 << -shift);
+		t.m.mat[i] = v > INT_MAX ? INT_MAX : v < INT_MIN ? INT_MIN : v;
+	}
+
+	return save_table(argv[1], &t, format) ? 1 : 0;
+}
+
+#define SHIFT_MAX 30	// 1 << SHIFT must fit an int
+
+static void usage(void)
+{
+	fprintf(stderr,
+			"usage: satcc-ctl info TABLE...\n"
+			"       satcc-ctl policy TABLE\n"
+			"       satcc-ctl heatmap TABLE\n"
+			"       satcc-ctl diff [-v] TABLE_A TABLE_B\n"
+			"       satcc-ctl merge [-f FORMAT] -o OUT TABLE...\n"
+			"       satcc-ctl convert [-f FORMAT] [-s SHIFT] IN OUT\n"
+			"\n"
+			"FORMAT is v1 (default), legacy or csv. SHIFT scales values by 2^SHIFT,\n"
+			"-%d to %d; values stay 32-bit in every format. diff exits 1 when the\n"
+			"policies differ, 2 on errors.\n", SHIFT_MAX, SHIFT_MAX);
+}
+
+int main(int argc, char **argv)
+{
+	const char *cmd;
+	const char *out = NULL;
+	const char *format = "v1";
+	int shift = 0;
+	char *end;
+	int opt;
+	int ret;
+
+	if (argc < 2)
+	{
+		usage();
+		return 2;
+	}
+	cmd = argv[1];
+	argc--;
+	argv++;
+
+	if (!strcmp(cmd, "merge") || !strcmp(cmd, "convert"))
+	{
+		while ((opt = getopt(argc, argv, "o:f:s:")) != -1)
+		{
+			switch (opt)
+			{
+			case 'o':
+				out = optarg;
+				break;
+			case 'f':
+				format = optarg;
+				break;
+			case 's':
+				shift = strtol(optarg, &end, 10);
+				if (*end || end == optarg || shift < -SHIFT_MAX || shift > SHIFT_MAX)
+				{
+					fprintf(stderr, "SHIFT must be between %d and %d\n", -SHIFT_MAX, SHIFT_MAX);
+					return 2;
+				}
+				break;
+			default:
+				usage();
+				return 2;
+			}
+		}
+		if (strcmp(format, "v1") && strcmp(format, "legacy") && strcmp(format, "csv"))
+		{
+			usage();
+			return 2;
+		}
+		argc -= optind;
+		argv += optind;
+	}
+	else
+	{
+		argc--;
+		argv++;
+	}
+
+	if (!strcmp(cmd, "info") && argc > 0)
+		ret = cmd_info(argc, argv);
+	else if (!strcmp(cmd, "policy"))
+		ret = cmd_policy(argc, argv, 0);
+	else if (!strcmp(cmd, "heatmap"))
+		ret = cmd_policy(argc, argv, 1);
+	else if (!strcmp(cmd, "diff"))
+		ret = cmd_diff(argc, argv);
+	else if (!strcmp(cmd, "merge"))
+		ret = cmd_merge(argc, argv, out, format);
+	else if (!strcmp(cmd, "convert"))
+		ret = cmd_convert(argc, argv, format, shift);
+	else
+		ret = -1;
+
+	if (ret < 0)
+	{
+		usage();
+		return 2;
+	}
+	return ret;
+}